@@ -1,4 +1,7 @@
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
 
 #include <framework/mlt_service.h>
 #include <framework/mlt_frame.h>
@@ -9,19 +12,72 @@
 
 #include "buffer_queue.h"
 
-struct buffer_wrapper_s
+// Audio ring storage. It's shared between the ring and audio views
+// handed out in frames, so it lives until the last of them drops it.
+struct audio_storage_s
 {
+	pthread_mutex_t mutex;
+	// Ring itself plus every view referencing storage
+	int ref_count;
+	// Sample data
+	uint8_t *data;
+	// Size of data in samples
+	size_t capacity;
+	// Absolute position of sample stored at index 0
+	int64_t base;
+	// Absolute positions of samples pinned by views (oldest first).
+	// Views are released in any order, so released ones are marked
+	// with -1 until everything before them gets released too.
+	int64_t *views;
+	int views_start;
+	int views_count;
+	int views_capacity;
+};
+
+typedef struct audio_storage_s *audio_storage;
+
+// Frame's reference to part of audio storage
+struct audio_view_s
+{
+	audio_storage storage;
+	int64_t position;
+};
+
+typedef struct audio_view_s *audio_view;
+
+// Media time of samples starting at given absolute position
+struct audio_mark_s
+{
+	int64_t position;
+	// In microseconds
+	int64_t pts;
+};
+
+// Decoded picture. It's shared by frames it's placed at (when it covers
+// several positions) and the queue, until a newer picture supersedes it.
+struct queued_picture_s
+{
+	int ref_count;
 	uint8_t *buffer;
-	size_t buffer_pos;
 	size_t buffer_size;
+	// Media time of the picture (in microseconds)
+	int64_t pts;
+	// Function returning buffer to where it came from
+	mlt_destructor release;
+	// Image format and dimensions
+	mlt_image_format vfmt;
+	int width;
+	int height;
 };
 
 struct buffer_queue_s
 {
 	// Owner of buffer_queue (that's where metadata is fetched from during initialization)
 	mlt_service owner;
+	// Frame rate frames are packed at (producer's snapshot, profile may change under us)
+	double fps;
 
-	// Total number of audio samples contained in audio_contents
+	// Total number of audio samples queued
 	unsigned int nb_audio_samples;
 	// Audio format used for storing audio
 	mlt_audio_format afmt;
@@ -29,105 +85,529 @@ struct buffer_queue_s
 	int channels;
 	// Sample rate of audio stored
 	int samplerate;
-	// Audio buffer data
-	mlt_deque audio_contents;
+	// Size of a single sample (all channels)
+	size_t sample_size;
+	// Ring of audio samples
+	audio_storage audio;
+	// Absolute position of the first queued sample
+	int64_t audio_position;
+	// Circular array of media times of queued audio
+	struct audio_mark_s *marks;
+	int marks_start;
+	int marks_count;
+	int marks_capacity;
 
 	// Image format used for storing image
 	mlt_image_format vfmt;
+	// Dimensions of stored image
+	int width;
+	int height;
 	// Video buffer data
 	mlt_deque video_contents;
 };
 
-typedef struct buffer_wrapper_s *buffer_wrapper;
+typedef struct queued_picture_s *queued_picture;
+
+// Decoded data of a packed frame, other frames can be made of
+struct buffer_queue_snapshot_s
+{
+	// Picture shared with the frame (NULL if it had none)
+	queued_picture picture;
+	// Copy of frame's audio (NULL if it had none)
+	uint8_t *audio;
+	int audio_size;
+	mlt_audio_format afmt;
+	int samplerate;
+	int channels;
+	int samples;
+};
+
+// Initial audio ring size (in seconds)
+#define AUDIO_RING_INITIAL_DURATION 1
+
+static void queued_picture_unref( queued_picture vb )
+{
+	if ( __atomic_sub_fetch( &vb->ref_count, 1, __ATOMIC_ACQ_REL ) == 0 )
+	{
+		vb->release( vb->buffer );
+		free( vb );
+	}
+}
+
+// Position picture belongs to, the one whose frame duration its timestamp
+// falls within. Timestamps are rounded to microseconds, so one falling short
+// of frame start by less than that still belongs to it.
+static mlt_position queued_picture_position( queued_picture vb, double fps )
+{
+	return floor( ( vb->pts + 1 ) * fps / 1000000.0 );
+}
 
-buffer_queue buffer_queue_init( mlt_service owner, mlt_image_format vfmt, mlt_audio_format afmt, int channels, int samplerate )
+static audio_storage audio_storage_init( size_t capacity, size_t sample_size, int64_t base )
+{
+	audio_storage storage = calloc( 1, sizeof( struct audio_storage_s ) );
+	if ( storage == NULL )
+		return NULL;
+
+	storage->data = mlt_pool_alloc( capacity * sample_size );
+	if ( storage->data == NULL || pthread_mutex_init( &storage->mutex, NULL ) != 0 )
+	{
+		mlt_pool_release( storage->data );
+		free( storage );
+		return NULL;
+	}
+	storage->ref_count = 1;
+	storage->capacity = capacity;
+	storage->base = base;
+
+	return storage;
+}
+
+static void audio_storage_unref( audio_storage storage )
+{
+	if ( storage == NULL )
+		return;
+
+	pthread_mutex_lock( &storage->mutex );
+	int ref_count = --storage->ref_count;
+	pthread_mutex_unlock( &storage->mutex );
+
+	if ( ref_count == 0 )
+	{
+		pthread_mutex_destroy( &storage->mutex );
+		mlt_pool_release( storage->data );
+		free( storage->views );
+		free( storage );
+	}
+}
+
+// Oldest absolute position still referenced by a view, or limit if there's none
+static int64_t audio_storage_pinned_position( audio_storage storage, int64_t limit )
+{
+	pthread_mutex_lock( &storage->mutex );
+	if ( storage->views_count > 0 )
+		limit = storage->views[ storage->views_start ];
+	pthread_mutex_unlock( &storage->mutex );
+	return limit;
+}
+
+static audio_view audio_storage_view( audio_storage storage, int64_t position )
+{
+	audio_view view = malloc( sizeof( struct audio_view_s ) );
+	if ( view == NULL )
+		return NULL;
+
+	pthread_mutex_lock( &storage->mutex );
+	if ( storage->views_count == storage->views_capacity )
+	{
+		int capacity = storage->views_capacity ? storage->views_capacity * 2 : 32;
+		int64_t *views = malloc( capacity * sizeof( int64_t ) );
+		if ( views == NULL )
+		{
+			pthread_mutex_unlock( &storage->mutex );
+			free( view );
+			return NULL;
+		}
+		int i;
+		for ( i = 0; i < storage->views_count; i++ )
+			views[ i ] = storage->views[ ( storage->views_start + i ) % storage->views_capacity ];
+		free( storage->views );
+		storage->views = views;
+		storage->views_start = 0;
+		storage->views_capacity = capacity;
+	}
+	storage->views[ ( storage->views_start + storage->views_count ) % storage->views_capacity ] = position;
+	storage->views_count++;
+	storage->ref_count++;
+	pthread_mutex_unlock( &storage->mutex );
+
+	view->storage = storage;
+	view->position = position;
+	return view;
+}
+
+static void audio_view_release( audio_view view )
+{
+	audio_storage storage = view->storage;
+
+	pthread_mutex_lock( &storage->mutex );
+	int i;
+	for ( i = 0; i < storage->views_count; i++ )
+	{
+		int index = ( storage->views_start + i ) % storage->views_capacity;
+		if ( storage->views[ index ] == view->position )
+		{
+			storage->views[ index ] = -1;
+			break;
+		}
+	}
+	// Unpin everything up to the oldest view still alive
+	while ( storage->views_count > 0 && storage->views[ storage->views_start ] == -1 )
+	{
+		storage->views_start = ( storage->views_start + 1 ) % storage->views_capacity;
+		storage->views_count--;
+	}
+	pthread_mutex_unlock( &storage->mutex );
+
+	audio_storage_unref( storage );
+	free( view );
+}
+
+// Media time of the first queued sample (in microseconds)
+static int64_t buffer_queue_audio_pts( buffer_queue self )
+{
+	struct audio_mark_s *mark = &self->marks[ self->marks_start ];
+	return mark->pts + ( self->audio_position - mark->position ) * 1000000 / self->samplerate;
+}
+
+static size_t buffer_queue_audio_index( buffer_queue self, int64_t position )
+{
+	return ( position - self->audio->base ) % self->audio->capacity;
+}
+
+// Makes sure count more samples fit into ring without touching pinned samples
+static int buffer_queue_reserve_audio( buffer_queue self, size_t count )
+{
+	int64_t end = self->audio_position + self->nb_audio_samples;
+	size_t capacity = self->samplerate * AUDIO_RING_INITIAL_DURATION;
+	size_t required = self->nb_audio_samples + count;
+	if ( self->audio )
+	{
+		// Samples still viewed by frames count as used
+		capacity = self->audio->capacity;
+		required = end + count - audio_storage_pinned_position( self->audio, self->audio_position );
+		if ( required <= capacity )
+			return 0;
+	}
+
+	// Queued samples move to new storage, old one lives on as long as views reference it.
+	// It's big enough to hold pinned samples too, so we don't end up here again.
+	while ( capacity < required )
+		capacity *= 2;
+
+	audio_storage storage = audio_storage_init( capacity, self->sample_size, self->audio_position );
+	if ( storage == NULL )
+		return 1;
+
+	if ( self->nb_audio_samples > 0 )
+	{
+		size_t index = buffer_queue_audio_index( self, self->audio_position );
+		size_t first = self->audio->capacity - index;
+		if ( first > self->nb_audio_samples )
+			first = self->nb_audio_samples;
+		memcpy( storage->data, self->audio->data + index * self->sample_size, first * self->sample_size );
+		memcpy( storage->data + first * self->sample_size, self->audio->data, ( self->nb_audio_samples - first ) * self->sample_size );
+	}
+	audio_storage_unref( self->audio );
+	self->audio = storage;
+
+	return 0;
+}
+
+// Drops count samples from front of audio ring
+static void buffer_queue_consume_audio( buffer_queue self, size_t count )
+{
+	self->audio_position += count;
+	self->nb_audio_samples -= count;
+
+	// Mark stays while there are samples it covers
+	while ( self->marks_count > 1 &&
+			self->marks[ ( self->marks_start + 1 ) % self->marks_capacity ].position <= self->audio_position )
+	{
+		self->marks_start = ( self->marks_start + 1 ) % self->marks_capacity;
+		self->marks_count--;
+	}
+	if ( self->nb_audio_samples == 0 )
+		self->marks_count = 0;
+}
+
+buffer_queue buffer_queue_init( mlt_service owner, double fps, mlt_image_format vfmt, mlt_audio_format afmt, int channels, int samplerate )
 {
 	if ( owner == NULL )
 		return NULL;
 
+	mlt_profile profile = mlt_service_profile( owner );
+
 	buffer_queue queue = calloc( 1, sizeof( struct buffer_queue_s ) );
 	if ( queue != NULL )
 	{
 		queue->owner = owner;
+		queue->fps = fps;
 
 		queue->nb_audio_samples = 0;
 		queue->afmt = afmt;
 		queue->channels = channels;
 		queue->samplerate = samplerate;
-		queue->audio_contents = mlt_deque_init( );
-		if ( queue->audio_contents == NULL ) goto cleanup;
+		queue->sample_size = mlt_audio_format_size( afmt, 1, channels );
+		if ( buffer_queue_reserve_audio( queue, 0 ) ) goto cleanup;
 
 		queue->vfmt = vfmt;
+		queue->width = profile->width;
+		queue->height = profile->height;
 		queue->video_contents = mlt_deque_init( );
 		if ( queue->video_contents == NULL ) goto cleanup;
 	}
 	return queue;
 
 cleanup:
-	if ( queue && queue->audio_contents ) mlt_deque_close( queue->audio_contents );
-	if ( queue && queue->video_contents ) mlt_deque_close( queue->video_contents );
+	if ( queue ) audio_storage_unref( queue->audio );
 	free( queue );
 	return NULL;
 }
 
-static int buffer_queue_insert_buffer( buffer_queue self, uint8_t *audio_buffer, size_t size, int is_audio )
+int buffer_queue_insert_audio_buffer( buffer_queue self, const uint8_t *audio_buffer, size_t size, int64_t pts )
 {
-	buffer_wrapper bw = calloc( 1, sizeof( struct buffer_wrapper_s ) );
-	if ( bw == NULL )
+	size_t count = size / self->sample_size;
+	if ( size % self->sample_size != 0 )
+		mlt_log( self->owner, MLT_LOG_WARNING, "%s\n", "buffer_queue_insert_audio_buffer: Invalid audio buffer size detected\n" );
+	if ( count == 0 )
+		return 0;
+
+	if ( buffer_queue_reserve_audio( self, count ) )
 		return 1;
 
-	bw->buffer = audio_buffer;
-	bw->buffer_pos = 0;
-	bw->buffer_size = size;
+	if ( self->marks_count == self->marks_capacity )
+	{
+		int capacity = self->marks_capacity ? self->marks_capacity * 2 : 64;
+		struct audio_mark_s *marks = malloc( capacity * sizeof( struct audio_mark_s ) );
+		if ( marks == NULL )
+			return 1;
+		int i;
+		for ( i = 0; i < self->marks_count; i++ )
+			marks[ i ] = self->marks[ ( self->marks_start + i ) % self->marks_capacity ];
+		free( self->marks );
+		self->marks = marks;
+		self->marks_start = 0;
+		self->marks_capacity = capacity;
+	}
 
-	mlt_deque deque_to_push;
-	if ( is_audio )
-		deque_to_push = self->audio_contents;
-	else
-		deque_to_push = self->video_contents;
+	int64_t position = self->audio_position + self->nb_audio_samples;
+	struct audio_mark_s *mark = &self->marks[ ( self->marks_start + self->marks_count ) % self->marks_capacity ];
+	mark->position = position;
+	mark->pts = pts;
+	self->marks_count++;
+
+	// At most two copies, when samples wrap around the end of ring
+	size_t index = buffer_queue_audio_index( self, position );
+	size_t first = self->audio->capacity - index;
+	if ( first > count )
+		first = count;
+	memcpy( self->audio->data + index * self->sample_size, audio_buffer, first * self->sample_size );
+	memcpy( self->audio->data, audio_buffer + first * self->sample_size, ( count - first ) * self->sample_size );
 
-	if ( mlt_deque_push_back( deque_to_push, bw ) )
+	self->nb_audio_samples += count;
+
+	return 0;
+}
+
+int buffer_queue_insert_video_buffer( buffer_queue self, uint8_t *video_buffer, size_t size, int64_t pts, mlt_destructor release )
+{
+	queued_picture vb = calloc( 1, sizeof( struct queued_picture_s ) );
+	if ( vb == NULL )
+		return 1;
+
+	vb->ref_count = 1;
+	vb->buffer = video_buffer;
+	vb->buffer_size = size;
+	vb->pts = pts;
+	vb->release = release;
+	vb->vfmt = self->vfmt;
+	vb->width = self->width;
+	vb->height = self->height;
+
+	if ( mlt_deque_push_back( self->video_contents, vb ) )
 	{
-		free( bw );
+		free( vb );
 		return 1;
 	}
 
-	// If we just pushed audio buffer, we need to update samples count
-	if ( is_audio )
+	return 0;
+}
+
+void buffer_queue_set_image_format( buffer_queue self, mlt_image_format vfmt, int width, int height )
+{
+	if ( self == NULL )
+		return;
+
+	// Buffers already queued keep the format they were inserted with
+	self->vfmt = vfmt;
+	self->width = width;
+	self->height = height;
+}
+
+int buffer_queue_trim_audio( buffer_queue self, int64_t timestamp )
+{
+	if ( self == NULL )
+		return 0;
+
+	// Find the latest chunk starting at (or before) timestamp. Everything
+	// queued before it is either stale (from before the seek) or too early.
+	int last_index = -1;
+	int iter;
+	for ( iter = 0; iter < self->marks_count; iter++ )
 	{
-		unsigned int samples_in_buffer =
-			size / mlt_audio_format_size( self->afmt, 1, self->channels );
-		if ( size % mlt_audio_format_size( self->afmt, 1, self->channels ) != 0 )
-			mlt_log( self->owner, MLT_LOG_WARNING, "%s\n", "buffer_queue_insert_buffer: Invalid audio buffer size detected\n" );
-		self->nb_audio_samples += samples_in_buffer;
+		struct audio_mark_s *mark = &self->marks[ ( self->marks_start + iter ) % self->marks_capacity ];
+		if ( mark->pts <= timestamp )
+			last_index = iter;
 	}
 
-	return 0;
+	// All the audio we have starts after timestamp, so there's nothing to trim
+	if ( last_index == -1 )
+		return self->nb_audio_samples == 0;
+
+	struct audio_mark_s mark = self->marks[ ( self->marks_start + last_index ) % self->marks_capacity ];
+	int64_t chunk_end = self->audio_position + self->nb_audio_samples;
+	if ( last_index + 1 < self->marks_count )
+		chunk_end = self->marks[ ( self->marks_start + last_index + 1 ) % self->marks_capacity ].position;
+
+	// Now skip samples preceding timestamp in the chunk containing it
+	int64_t position = mark.position + ( timestamp - mark.pts ) * self->samplerate / 1000000;
+	if ( position > chunk_end )
+		position = chunk_end;
+	if ( position > self->audio_position )
+		buffer_queue_consume_audio( self, position - self->audio_position );
+
+	// If there's nothing left, the audio at timestamp hasn't arrived yet
+	return self->nb_audio_samples == 0;
 }
 
-int buffer_queue_insert_audio_buffer( buffer_queue self, uint8_t *audio_buffer, size_t size )
+void buffer_queue_shift_audio( buffer_queue self, int64_t offset )
 {
-	return buffer_queue_insert_buffer( self, audio_buffer, size, 1 );
+	if ( self == NULL )
+		return;
+
+	int iter;
+	for ( iter = 0; iter < self->marks_count; iter++ )
+		self->marks[ ( self->marks_start + iter ) % self->marks_capacity ].pts += offset;
+}
+
+void buffer_queue_purge_audio( buffer_queue self )
+{
+	if ( self == NULL )
+		return;
+
+	buffer_queue_consume_audio( self, self->nb_audio_samples );
+}
+
+// Hands decoded picture over to frame only when someone actually asks for image
+static int buffer_queue_get_image( mlt_frame frame, uint8_t **buffer, mlt_image_format *format, int *width, int *height, int writable )
+{
+	mlt_properties frame_properties = MLT_FRAME_PROPERTIES( frame );
+
+	int size = 0;
+	uint8_t *image = mlt_properties_get_data( frame_properties, "_buffer_queue_image", &size );
+	queued_picture vb = mlt_properties_get_data( frame_properties, "_buffer_queue_picture", NULL );
+	if ( image == NULL || vb == NULL )
+		return 1;
+
+	mlt_image_format native_format = mlt_properties_get_int( frame_properties, "format" );
+	*width = mlt_properties_get_int( frame_properties, "width" );
+	*height = mlt_properties_get_int( frame_properties, "height" );
+
+	// Picture other frames (or queue) still share gets copied before anyone writes to it
+	if ( writable && __atomic_load_n( &vb->ref_count, __ATOMIC_ACQUIRE ) > 1 )
+	{
+		uint8_t *copy = mlt_pool_alloc( size );
+		if ( copy == NULL )
+			return 1;
+		memcpy( copy, image, size );
+		image = copy;
+		mlt_frame_set_image( frame, image, size, ( mlt_destructor )mlt_pool_release );
+	}
+	else
+	{
+		// Decoded buffer stays owned by "_buffer_queue_picture" property
+		mlt_frame_set_image( frame, image, size, NULL );
+	}
+	*buffer = image;
+
+	// Convert only when requested format differs from what decoder gave us
+	if ( *format == mlt_image_none || *format == native_format )
+	{
+		*format = native_format;
+	}
+	else if ( frame->convert_image != NULL )
+	{
+		mlt_image_format requested_format = *format;
+		*format = native_format;
+		if ( frame->convert_image( frame, buffer, format, requested_format ) )
+			*format = native_format;
+	}
+	else
+	{
+		*format = native_format;
+	}
+
+	return 0;
 }
 
-int buffer_queue_insert_video_buffer( buffer_queue self, uint8_t *video_buffer, size_t size )
+// Frame shares the picture with whoever else holds it. Image is attached
+// lazily, so frames dropped unseen don't pay for it.
+static void buffer_queue_attach_picture( mlt_frame frame, queued_picture vb )
 {
-	return buffer_queue_insert_buffer( self, video_buffer, size, 0 );
+	mlt_properties frame_properties = MLT_FRAME_PROPERTIES( frame );
+
+	__atomic_add_fetch( &vb->ref_count, 1, __ATOMIC_RELAXED );
+	mlt_properties_set_data( frame_properties, "_buffer_queue_picture", vb, 0,
+							 ( mlt_destructor )queued_picture_unref, NULL );
+	mlt_properties_set_data( frame_properties, "_buffer_queue_image", vb->buffer, vb->buffer_size, NULL, NULL );
+	mlt_frame_push_get_image( frame, buffer_queue_get_image );
+	mlt_properties_set_int( frame_properties, "format", vb->vfmt );
+	mlt_properties_set_int( frame_properties, "width", vb->width );
+	mlt_properties_set_int( frame_properties, "height", vb->height );
 }
 
-mlt_frame buffer_queue_pack_frame( buffer_queue self, mlt_position position )
+// Frames are placed by timestamps, not by counting buffers. Picture for a
+// position is the earliest one within its frame duration. Without one, the
+// latest picture preceding it gets repeated (pictures later than position are
+// taken only when there's nothing to repeat, e.g. right after seek). Pictures
+// missing or extra in variable frame rate sources don't shift frames that follow. Audio gaps are filled with silence
+// and overlaps are dropped the same way.
+mlt_frame buffer_queue_pack_frame( buffer_queue self, mlt_position position, int with_audio, int with_video )
 {
 	mlt_frame frame = NULL;
-	mlt_profile profile = mlt_service_profile( self->owner );
+	double fps = self->fps;
 
+	queued_picture vb = NULL;
+	if ( with_video )
+	{
+		// Pictures superseded by a newer one no later than position are dropped,
+		// the latest one preceding position stays to be repeated
+		while ( mlt_deque_count( self->video_contents ) > 1 )
+		{
+			queued_picture front = mlt_deque_peek_front( self->video_contents );
+			queued_picture next = mlt_deque_peek( self->video_contents, 1 );
+			if ( queued_picture_position( front, fps ) == position || queued_picture_position( next, fps ) > position )
+				break;
+			queued_picture_unref( mlt_deque_pop_front( self->video_contents ) );
+		}
 
-	// Firstly, if we don't have any image buffers, we won't make a frame
-	if ( mlt_deque_count( self->video_contents ) == 0 )
-		return NULL;
+		// Firstly, if we don't have any image buffers, we won't make a frame
+		vb = mlt_deque_peek_front( self->video_contents );
+		if ( vb == NULL )
+			return NULL;
+
+		// Picture preceding position gets duplicated only once we know
+		// there's no picture for position itself
+		if ( mlt_deque_count( self->video_contents ) == 1 && queued_picture_position( vb, fps ) < position )
+			return NULL;
+	}
 
 	// Secondly, if we don't have enough audio samples, we won't make a frame too
-	int needed_samples = mlt_sample_calculator( mlt_profile_fps( profile ), self->samplerate, position );
-	if ( needed_samples > self->nb_audio_samples )
+	int needed_samples = mlt_sample_calculator( fps, self->samplerate, position );
+	int silence = 0;
+	if ( with_audio && self->nb_audio_samples > 0 )
+	{
+		// Distance (in samples) between queued audio and frame start. Small
+		// ones are left alone, so sample accurate audio isn't touched.
+		int64_t frame_start = mlt_sample_calculator_to_now( fps, self->samplerate, position );
+		int64_t skew = buffer_queue_audio_pts( self ) * self->samplerate / 1000000 - frame_start;
+		if ( skew < -needed_samples / 2 )
+			buffer_queue_consume_audio( self, -skew < self->nb_audio_samples ? -skew : self->nb_audio_samples );
+		else if ( skew > needed_samples / 2 )
+			silence = skew < needed_samples ? skew : needed_samples;
+	}
+	int queued_samples = needed_samples - silence;
+	if ( with_audio && queued_samples > self->nb_audio_samples )
 	{
 		return NULL;
 	}
@@ -138,82 +618,187 @@ mlt_frame buffer_queue_pack_frame( buffer_queue self, mlt_position position )
 		return NULL;
 	mlt_properties frame_properties = mlt_frame_properties( frame );
 
-	uint8_t *audio_buffer = NULL;
-	uint8_t *video_buffer = NULL;
-	size_t audio_buffer_size;
-	size_t video_buffer_size;
-
-	audio_buffer_size = mlt_audio_format_size( self->afmt, needed_samples, self->channels );
-	audio_buffer = mlt_pool_alloc( audio_buffer_size );
-	if ( audio_buffer == NULL )
-		return NULL;
-
-	// First we fill the audio buffers TODO
-	size_t audio_buffer_iter = 0;
-	while ( audio_buffer_iter < audio_buffer_size )
+	// Frame without audio gets silence from MLT
+	if ( with_audio )
 	{
-		buffer_wrapper abw = mlt_deque_pop_front( self->audio_contents );
-		while ( abw->buffer_pos != abw->buffer_size && audio_buffer_iter < audio_buffer_size )
-		{
-			audio_buffer[ audio_buffer_iter ] = abw->buffer[ abw->buffer_pos ];
-			audio_buffer_iter++;
-			abw->buffer_pos++;
-		}
-		// We've got some samples left in abw, but we finished packing frame
-		if ( abw->buffer_pos != abw->buffer_size )
+		size_t audio_buffer_size = needed_samples * self->sample_size;
+		size_t index = buffer_queue_audio_index( self, self->audio_position );
+		uint8_t *audio_buffer = NULL;
+
+		// If samples don't wrap around, frame gets a view of the ring
+		if ( silence == 0 && index + needed_samples <= self->audio->capacity )
 		{
-			mlt_deque_push_front( self->audio_contents, abw );
+			audio_view view = audio_storage_view( self->audio, self->audio_position );
+			if ( view != NULL )
+			{
+				audio_buffer = self->audio->data + index * self->sample_size;
+				mlt_properties_set_data( frame_properties, "_buffer_queue_audio", view, 0,
+										 ( mlt_destructor )audio_view_release, NULL );
+				mlt_frame_set_audio( frame, audio_buffer, self->afmt, audio_buffer_size, NULL );
+			}
 		}
-		// No samples left in abw
-		else
+		// Otherwise (or if view couldn't be made) we copy both parts after silence
+		if ( audio_buffer == NULL )
 		{
-			mlt_pool_release( abw->buffer );
-			free( abw );
+			audio_buffer = mlt_pool_alloc( audio_buffer_size );
+			if ( audio_buffer == NULL )
+			{
+				mlt_frame_close( frame );
+				return NULL;
+			}
+			memset( audio_buffer, 0, silence * self->sample_size );
+			uint8_t *queued = audio_buffer + silence * self->sample_size;
+			size_t first = self->audio->capacity - index;
+			if ( first > queued_samples )
+				first = queued_samples;
+			memcpy( queued, self->audio->data + index * self->sample_size, first * self->sample_size );
+			memcpy( queued + first * self->sample_size, self->audio->data, ( queued_samples - first ) * self->sample_size );
+			mlt_frame_set_audio( frame, audio_buffer, self->afmt, audio_buffer_size, ( mlt_destructor )mlt_pool_release );
 		}
+		buffer_queue_consume_audio( self, queued_samples );
 	}
-	self->nb_audio_samples -= needed_samples;
 
-	// Now we fill the video buffer
-	buffer_wrapper vbw = mlt_deque_pop_front( self->video_contents );
-	video_buffer = vbw->buffer;
-	video_buffer_size = vbw->buffer_size;
-	free( vbw );
-
-	// Now it's time to bind the buffers to mlt_frame
-	// TODO: Is this approach compatible with image/audio frame stacks?
-	mlt_frame_set_audio( frame, audio_buffer, self->afmt, audio_buffer_size, ( mlt_destructor )mlt_pool_release );
 	mlt_properties_set_int( frame_properties, "audio_frequency", self->samplerate );
 	mlt_properties_set_int( frame_properties, "audio_channels", self->channels );
 	mlt_properties_set_int( frame_properties, "audio_samples", needed_samples );
 
-	mlt_frame_set_image( frame, video_buffer, video_buffer_size, ( mlt_destructor )mlt_pool_release );
-	mlt_properties_set_int( frame_properties, "format", self->vfmt );
-	mlt_properties_set_int( frame_properties, "width", profile->width );
-	mlt_properties_set_int( frame_properties, "height", profile->height );
-
 	mlt_frame_set_position( frame, position );
 
+	// Frame without image gets one from MLT
+	if ( !with_video )
+		return frame;
+
+	// Picture stays queued, next positions may need it too
+	buffer_queue_attach_picture( frame, vb );
+
 	return frame;
 }
 
-void buffer_queue_purge( buffer_queue self )
+size_t buffer_queue_frame_size( mlt_frame frame )
 {
-	if ( self == NULL )
-		return;
+	mlt_properties frame_properties = MLT_FRAME_PROPERTIES( frame );
+
+	int image_size = 0;
+	int audio_size = 0;
+	mlt_properties_get_data( frame_properties, "_buffer_queue_image", &image_size );
+	mlt_properties_get_data( frame_properties, "audio", &audio_size );
+
+	return image_size + audio_size;
+}
 
-	buffer_wrapper bw;
-	while ( bw = mlt_deque_pop_front( self->audio_contents ) )
+buffer_queue_snapshot buffer_queue_snapshot_init( mlt_frame frame )
+{
+	mlt_properties frame_properties = MLT_FRAME_PROPERTIES( frame );
+
+	buffer_queue_snapshot snapshot = calloc( 1, sizeof( struct buffer_queue_snapshot_s ) );
+	if ( snapshot == NULL )
+		return NULL;
+
+	// Frame is fresh from buffer_queue_pack_frame(), nobody could have touched its audio yet
+	int audio_size = 0;
+	uint8_t *audio = mlt_properties_get_data( frame_properties, "audio", &audio_size );
+	if ( audio != NULL && audio_size > 0 )
 	{
-		mlt_pool_release( bw->buffer );
-		free( bw );
+		snapshot->audio = mlt_pool_alloc( audio_size );
+		if ( snapshot->audio == NULL )
+		{
+			free( snapshot );
+			return NULL;
+		}
+		memcpy( snapshot->audio, audio, audio_size );
+		snapshot->audio_size = audio_size;
+		snapshot->afmt = mlt_properties_get_int( frame_properties, "audio_format" );
 	}
-	while ( bw = mlt_deque_pop_front( self->video_contents ) )
+	snapshot->samplerate = mlt_properties_get_int( frame_properties, "audio_frequency" );
+	snapshot->channels = mlt_properties_get_int( frame_properties, "audio_channels" );
+	snapshot->samples = mlt_properties_get_int( frame_properties, "audio_samples" );
+
+	snapshot->picture = mlt_properties_get_data( frame_properties, "_buffer_queue_picture", NULL );
+	if ( snapshot->picture != NULL )
+		__atomic_add_fetch( &snapshot->picture->ref_count, 1, __ATOMIC_RELAXED );
+
+	return snapshot;
+}
+
+// Frames made from snapshot share its picture (which gets copied before anyone
+// writes to it), but each of them gets audio of its own
+mlt_frame buffer_queue_snapshot_frame( buffer_queue_snapshot snapshot, mlt_service owner, mlt_position position )
+{
+	mlt_frame frame = mlt_frame_init( owner );
+	if ( frame == NULL )
+		return NULL;
+	mlt_properties frame_properties = MLT_FRAME_PROPERTIES( frame );
+
+	if ( snapshot->audio != NULL )
 	{
-		mlt_pool_release( bw->buffer );
-		free( bw );
+		uint8_t *audio = mlt_pool_alloc( snapshot->audio_size );
+		if ( audio == NULL )
+		{
+			mlt_frame_close( frame );
+			return NULL;
+		}
+		memcpy( audio, snapshot->audio, snapshot->audio_size );
+		mlt_frame_set_audio( frame, audio, snapshot->afmt, snapshot->audio_size, ( mlt_destructor )mlt_pool_release );
 	}
+	mlt_properties_set_int( frame_properties, "audio_frequency", snapshot->samplerate );
+	mlt_properties_set_int( frame_properties, "audio_channels", snapshot->channels );
+	mlt_properties_set_int( frame_properties, "audio_samples", snapshot->samples );
+
+	mlt_frame_set_position( frame, position );
+
+	if ( snapshot->picture != NULL )
+		buffer_queue_attach_picture( frame, snapshot->picture );
+
+	return frame;
+}
 
-	self->nb_audio_samples = 0;
+// Makes a fresh frame of owner with the data of frame packed by buffer_queue_pack_frame(),
+// so frame itself is never handed out to more than one caller
+mlt_frame buffer_queue_frame_clone( mlt_frame frame, mlt_service owner )
+{
+	mlt_properties frame_properties = MLT_FRAME_PROPERTIES( frame );
+
+	// Frame isn't handed out, nobody could have touched its audio
+	struct buffer_queue_snapshot_s snapshot;
+	memset( &snapshot, 0, sizeof( snapshot ) );
+	snapshot.audio = mlt_properties_get_data( frame_properties, "audio", &snapshot.audio_size );
+	if ( snapshot.audio_size <= 0 )
+		snapshot.audio = NULL;
+	snapshot.afmt = mlt_properties_get_int( frame_properties, "audio_format" );
+	snapshot.samplerate = mlt_properties_get_int( frame_properties, "audio_frequency" );
+	snapshot.channels = mlt_properties_get_int( frame_properties, "audio_channels" );
+	snapshot.samples = mlt_properties_get_int( frame_properties, "audio_samples" );
+	snapshot.picture = mlt_properties_get_data( frame_properties, "_buffer_queue_picture", NULL );
+
+	return buffer_queue_snapshot_frame( &snapshot, owner, mlt_frame_get_position( frame ) );
+}
+
+size_t buffer_queue_snapshot_size( buffer_queue_snapshot snapshot )
+{
+	return ( snapshot->picture ? snapshot->picture->buffer_size : 0 ) + snapshot->audio_size;
+}
+
+void buffer_queue_snapshot_close( buffer_queue_snapshot snapshot )
+{
+	if ( snapshot == NULL )
+		return;
+
+	if ( snapshot->picture != NULL )
+		queued_picture_unref( snapshot->picture );
+	mlt_pool_release( snapshot->audio );
+	free( snapshot );
+}
+
+void buffer_queue_purge( buffer_queue self )
+{
+	if ( self == NULL )
+		return;
+
+	buffer_queue_purge_audio( self );
+
+	queued_picture vb;
+	while ( ( vb = mlt_deque_pop_front( self->video_contents ) ) )
+		queued_picture_unref( vb );
 }
 
 void buffer_queue_close( buffer_queue self )
@@ -222,7 +807,8 @@ void buffer_queue_close( buffer_queue self )
 		return;
 
 	buffer_queue_purge( self );
-	mlt_deque_close( self->audio_contents );
+	audio_storage_unref( self->audio );
+	free( self->marks );
 	mlt_deque_close( self->video_contents );
 	free( self );
-}
\ No newline at end of file
+}
@@ -1,10 +1,21 @@
 #include <framework/mlt_types.h>
 
 typedef struct buffer_queue_s *buffer_queue;
+typedef struct buffer_queue_snapshot_s *buffer_queue_snapshot;
 
-extern buffer_queue buffer_queue_init( mlt_service owner, mlt_image_format vfmt, mlt_audio_format afmt, int channels, int samplerate );
-extern int buffer_queue_insert_audio_buffer( buffer_queue self, uint8_t *audio_buffer, size_t size );
-extern int buffer_queue_insert_video_buffer( buffer_queue self, uint8_t *video_buffer, size_t size );
-extern mlt_frame buffer_queue_pack_frame( buffer_queue self, mlt_position position );
+extern buffer_queue buffer_queue_init( mlt_service owner, double fps, mlt_image_format vfmt, mlt_audio_format afmt, int channels, int samplerate );
+extern int buffer_queue_insert_audio_buffer( buffer_queue self, const uint8_t *audio_buffer, size_t size, int64_t pts );
+extern int buffer_queue_insert_video_buffer( buffer_queue self, uint8_t *video_buffer, size_t size, int64_t pts, mlt_destructor release );
+extern void buffer_queue_set_image_format( buffer_queue self, mlt_image_format vfmt, int width, int height );
+extern int buffer_queue_trim_audio( buffer_queue self, int64_t timestamp );
+extern void buffer_queue_shift_audio( buffer_queue self, int64_t offset );
+extern void buffer_queue_purge_audio( buffer_queue self );
+extern mlt_frame buffer_queue_pack_frame( buffer_queue self, mlt_position position, int with_audio, int with_video );
+extern size_t buffer_queue_frame_size( mlt_frame frame );
+extern mlt_frame buffer_queue_frame_clone( mlt_frame frame, mlt_service owner );
+extern buffer_queue_snapshot buffer_queue_snapshot_init( mlt_frame frame );
+extern mlt_frame buffer_queue_snapshot_frame( buffer_queue_snapshot snapshot, mlt_service owner, mlt_position position );
+extern size_t buffer_queue_snapshot_size( buffer_queue_snapshot snapshot );
+extern void buffer_queue_snapshot_close( buffer_queue_snapshot snapshot );
 extern void buffer_queue_purge( buffer_queue self );
 extern void buffer_queue_close( buffer_queue self );
@@ -7,6 +7,8 @@
 #include <assert.h>
 #include <string.h>
 
+#include "vlc_instance.h"
+
 #define VIDEO_COOKIE 0
 #define AUDIO_COOKIE 1
 
@@ -34,31 +36,6 @@ struct consumer_libvlc_s
 	int output_to_window;
 };
 
-static void log_cb( void *data, int vlc_level, const libvlc_log_t *ctx, const char *fmt, va_list args )
-{
-	consumer_libvlc self = data;
-	int consumer_id = self->id;
-
-	int mlt_level;
-	switch ( vlc_level )
-	{
-		case LIBVLC_DEBUG:
-			mlt_level = MLT_LOG_DEBUG;
-			break;
-		case LIBVLC_NOTICE:
-			mlt_level = MLT_LOG_INFO;
-			break;
-		case LIBVLC_WARNING:
-			mlt_level = MLT_LOG_WARNING;
-			break;
-		case LIBVLC_ERROR:
-		default:
-			mlt_level = MLT_LOG_FATAL;
-	}
-
-	mlt_vlog( MLT_CONSUMER_SERVICE( self->parent ), mlt_level, fmt, args );
-}
-
 static void setup_vlc( consumer_libvlc self );
 static void setup_vlc_sout( consumer_libvlc self );
 static int setup_vlc_window( consumer_libvlc self );
@@ -104,12 +81,10 @@ mlt_consumer consumer_libvlc_init( mlt_profile profile, mlt_service_type type, c
 	mlt_properties_set( properties, "output_mux", "ps" );
 	mlt_properties_set( properties, "output_access", "file" );
 
-	self->vlc = libvlc_new( 0, NULL );
+	// VLC instance is shared by all libvlc services in process
+	self->vlc = vlc_instance_acquire( );
 	assert( self->vlc != NULL );
 
-	// Debug code
-	libvlc_log_set( self->vlc, log_cb, self );
-
 	self->frame_queue = mlt_deque_init( );
 	assert( self->frame_queue != NULL );
 
@@ -344,6 +319,9 @@ static int imem_get( void *data, const char* cookie, int64_t *dts, int64_t *pts,
 	int cleanup_frame = 0;
 	*buffer = NULL;
 
+	// Messages of VLC objects running in this thread belong to us
+	vlc_instance_log_thread( MLT_CONSUMER_SERVICE( self->parent ) );
+
 	int cookie_int = cookie[ 0 ] - '0';
 
 	// Get data if needed
@@ -511,6 +489,7 @@ static int consumer_start( mlt_consumer parent )
 		// Free all previous resources
 		if ( self->media_player )
 		{
+			vlc_instance_log_unregister( self->media_player );
 			libvlc_media_player_release( self->media_player );
 			self->media_player = NULL;
 		}
@@ -524,6 +503,7 @@ static int consumer_start( mlt_consumer parent )
 		setup_vlc( self );
 		self->media_player = libvlc_media_player_new_from_media( self->media );
 		assert( self->media_player != NULL );
+		vlc_instance_log_register( self->media_player, MLT_CONSUMER_SERVICE( self->parent ) );
 
 		// Set window output if we're using it
 		if ( self->output_to_window )
@@ -608,13 +588,16 @@ static void consumer_close( mlt_consumer parent )
 		consumer_stop( parent );
 
 		if ( self->media_player )
+		{
+			vlc_instance_log_unregister( self->media_player );
 			libvlc_media_player_release( self->media_player );
+		}
 
 		if ( self->media )
 			libvlc_media_release( self->media );
 
 		if ( self->vlc )
-			libvlc_release( self->vlc );
+			vlc_instance_release( self->vlc );
 
 		pthread_mutex_destroy( &self->queue_mutex );
 		free( self );
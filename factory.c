@@ -16,10 +16,12 @@ static mlt_properties metadata( mlt_service_type type, const char *id, void *dat
 MLT_REPOSITORY
 {
 	MLT_REGISTER( producer_type, "libvlc", producer_libvlc_init );
+	MLT_REGISTER( producer_type, "libvlc_thumbnails", producer_libvlc_init );
 	MLT_REGISTER( consumer_type, "libvlc", consumer_libvlc_init );
 	MLT_REGISTER( consumer_type, "libvlc_window", consumer_libvlc_init );
 
 	MLT_REGISTER_METADATA( producer_type, "libvlc", metadata, "producer_libvlc.yml" );
+	MLT_REGISTER_METADATA( producer_type, "libvlc_thumbnails", metadata, "producer_libvlc_thumbnails.yml" );
 	MLT_REGISTER_METADATA( consumer_type, "libvlc", metadata, "consumer_libvlc.yml" );
 	MLT_REGISTER_METADATA( consumer_type, "libvlc_window", metadata, "consumer_libvlc_window.yml" );
 }
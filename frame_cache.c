@@ -1,5 +1,5 @@
 /*
-Consecutive frame cache.
+Segmented frame cache.
 
 This is written with libVLC producer in mind,
 which produces consecutive raw audio/video samples,
@@ -7,12 +7,27 @@ then packs it into consecutive mlt_frames. The frames are then
 put into this cache, so they could be available when some MLT
 consumer requests them.
 
-If we have a cache miss, we will usually need to seek libVLC,
-purge cache, and start putting the frames into it again.
+Frames are kept in a few contiguous segments. Frame that is not next
+in sequence starts a new segment (after a seek, for example), so jumping
+back to recently viewed region doesn't need libVLC to seek and decode
+again. When cache is over its memory budget, the least recently used
+segment loses its earliest frames.
+
+Besides its own budget, every cache draws from an optional process-wide
+budget. When all caches together go over it, the least recently used
+frames of any cache get evicted first. Memory held outside of caches
+(frames published to shared cache) gets reserved from it too.
+
+Segments starting within protected range are never evicted from,
+since the producer is about to play frames from them.
 
 libVLC producer will produce non writable frames...
 */
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <framework/mlt_frame.h>
 #include <framework/mlt_types.h>
@@ -20,32 +35,226 @@ libVLC producer will produce non writable frames...
 
 #include "frame_cache.h"
 
-struct frame_cache_s
+// Maximum number of separate segments kept in cache
+#define FRAME_CACHE_MAX_SEGMENTS 8
+
+struct frame_cache_entry_s
 {
-	// Circular buffer of mlt_frames
-	mlt_frame *frames;
+	mlt_frame frame;
+	// Memory taken by frame
+	size_t size;
+};
+
+struct frame_cache_segment_s
+{
+	// Circular buffer of cached frames
+	struct frame_cache_entry_s *entries;
+	// Number of entries buffer can hold
+	size_t capacity;
 	// Index, which points to first frame
 	size_t start_pos;
-	// How many frames are in cache currently
+	// How many frames are in segment currently
 	size_t frames_total;
-	// How many frames max in cache
+	// Time segment was last used (in microseconds)
+	int64_t last_use;
+};
+
+typedef struct frame_cache_segment_s *frame_cache_segment;
+
+struct frame_cache_s
+{
+	pthread_mutex_t mutex;
+	struct frame_cache_segment_s segments[ FRAME_CACHE_MAX_SEGMENTS ];
+	// Segment, which new frames are appended to (-1 if none)
+	int active;
+	// Memory taken by frames in cache currently
 	size_t size;
+	// Memory budget of this cache
+	size_t size_max;
+	// Segments starting in this range are never evicted from
+	mlt_position protected_from;
+	mlt_position protected_to;
+	// Next cache sharing process-wide budget
+	frame_cache next;
 };
 
-static ssize_t frame_cache_frame_index( frame_cache self, mlt_position position )
+// Process-wide budget shared by all caches
+static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+static frame_cache global_caches = NULL;
+static size_t global_size_max = 0;
+// Memory held outside frame caches (e.g. by shared cache), counted against the budget too
+static size_t global_external_size = 0;
+
+static int64_t frame_cache_time( )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ( int64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct frame_cache_entry_s *frame_cache_entry( frame_cache_segment segment, size_t offset )
 {
-	if ( self->frames_total == 0 )
-		return -1;
+	return &segment->entries[ ( segment->start_pos + offset ) % segment->capacity ];
+}
 
-	mlt_frame first_frame = self->frames[ self->start_pos ];
-	mlt_position first_frame_position = mlt_frame_original_position( first_frame );
-	mlt_position last_frame_position = first_frame_position + self->frames_total - 1;
+static mlt_position frame_cache_segment_first( frame_cache_segment segment )
+{
+	return mlt_frame_original_position( frame_cache_entry( segment, 0 )->frame );
+}
+
+static mlt_position frame_cache_segment_last( frame_cache_segment segment )
+{
+	return frame_cache_segment_first( segment ) + segment->frames_total - 1;
+}
+
+static struct frame_cache_entry_s *frame_cache_segment_find( frame_cache_segment segment, mlt_position position )
+{
+	if ( segment->frames_total == 0 )
+		return NULL;
+
+	mlt_position first_frame_position = frame_cache_segment_first( segment );
+	mlt_position last_frame_position = first_frame_position + segment->frames_total - 1;
 	if ( position >= first_frame_position && position <= last_frame_position )
+		return frame_cache_entry( segment, position - first_frame_position );
+	return NULL;
+}
+
+// Finds segment containing position and its entry for it
+static frame_cache_segment frame_cache_find( frame_cache self, mlt_position position, struct frame_cache_entry_s **entry )
+{
+	int i;
+	for ( i = 0; i < FRAME_CACHE_MAX_SEGMENTS; i++ )
 	{
-		int offset = position - first_frame_position;
-		return ( self->start_pos + offset ) % self->size;
+		*entry = frame_cache_segment_find( &self->segments[ i ], position );
+		if ( *entry != NULL )
+			return &self->segments[ i ];
 	}
-	return -1;
+	return NULL;
+}
+
+static void frame_cache_drop_earliest( frame_cache self, frame_cache_segment segment )
+{
+	struct frame_cache_entry_s *entry = frame_cache_entry( segment, 0 );
+	mlt_frame_close( entry->frame );
+	self->size -= entry->size;
+	segment->start_pos = ( segment->start_pos + 1 ) % segment->capacity;
+	segment->frames_total--;
+}
+
+static void frame_cache_purge_segment( frame_cache self, frame_cache_segment segment )
+{
+	while ( segment->frames_total > 0 )
+		frame_cache_drop_earliest( self, segment );
+	segment->start_pos = 0;
+}
+
+static int frame_cache_segment_grow( frame_cache_segment segment )
+{
+	size_t capacity = segment->capacity ? segment->capacity * 2 : 32;
+	struct frame_cache_entry_s *entries = malloc( capacity * sizeof( struct frame_cache_entry_s ) );
+	if ( entries == NULL )
+		return 1;
+
+	size_t i;
+	for ( i = 0; i < segment->frames_total; i++ )
+		entries[ i ] = *frame_cache_entry( segment, i );
+	free( segment->entries );
+	segment->entries = entries;
+	segment->capacity = capacity;
+	segment->start_pos = 0;
+	return 0;
+}
+
+static int frame_cache_segment_evictable( frame_cache self, frame_cache_segment segment )
+{
+	if ( segment->frames_total == 0 )
+		return 0;
+
+	mlt_position first = frame_cache_segment_first( segment );
+	return first < self->protected_from || first > self->protected_to;
+}
+
+// Least recently used segment we're allowed to evict from. Segment being filled
+// is used only if it's the last one left.
+// WARNING: Lock cache mutex before calling this function
+static frame_cache_segment frame_cache_victim( frame_cache self )
+{
+	frame_cache_segment victim = NULL;
+	int i;
+	for ( i = 0; i < FRAME_CACHE_MAX_SEGMENTS; i++ )
+	{
+		frame_cache_segment segment = &self->segments[ i ];
+		if ( i == self->active || !frame_cache_segment_evictable( self, segment ) )
+			continue;
+		if ( victim == NULL || segment->last_use < victim->last_use )
+			victim = segment;
+	}
+	if ( victim == NULL && self->active != -1 && frame_cache_segment_evictable( self, &self->segments[ self->active ] ) )
+		victim = &self->segments[ self->active ];
+	return victim;
+}
+
+// Evicts least recently used frames of all caches, until they fit into process-wide budget
+static void frame_cache_enforce_global_budget( )
+{
+	pthread_mutex_lock( &global_mutex );
+
+	while ( global_size_max > 0 )
+	{
+		size_t total = global_external_size;
+		frame_cache oldest = NULL;
+		int64_t oldest_use = INT64_MAX;
+		frame_cache cache;
+		for ( cache = global_caches; cache != NULL; cache = cache->next )
+		{
+			pthread_mutex_lock( &cache->mutex );
+			total += cache->size;
+			frame_cache_segment victim = frame_cache_victim( cache );
+			if ( victim != NULL && victim->last_use < oldest_use )
+			{
+				oldest = cache;
+				oldest_use = victim->last_use;
+			}
+			pthread_mutex_unlock( &cache->mutex );
+		}
+
+		if ( total <= global_size_max || oldest == NULL )
+			break;
+
+		pthread_mutex_lock( &oldest->mutex );
+		frame_cache_segment victim = frame_cache_victim( oldest );
+		if ( victim != NULL )
+			frame_cache_drop_earliest( oldest, victim );
+		pthread_mutex_unlock( &oldest->mutex );
+	}
+
+	pthread_mutex_unlock( &global_mutex );
+}
+
+void frame_cache_set_global_size( size_t size_max )
+{
+	pthread_mutex_lock( &global_mutex );
+	global_size_max = size_max;
+	pthread_mutex_unlock( &global_mutex );
+
+	frame_cache_enforce_global_budget( );
+}
+
+// Memory taken outside frame caches, which frame caches make room for
+void frame_cache_global_reserve( size_t size )
+{
+	pthread_mutex_lock( &global_mutex );
+	global_external_size += size;
+	pthread_mutex_unlock( &global_mutex );
+
+	frame_cache_enforce_global_budget( );
+}
+
+void frame_cache_global_release( size_t size )
+{
+	pthread_mutex_lock( &global_mutex );
+	global_external_size -= size < global_external_size ? size : global_external_size;
+	pthread_mutex_unlock( &global_mutex );
 }
 
 frame_cache frame_cache_init( size_t size_max )
@@ -57,19 +266,39 @@ frame_cache frame_cache_init( size_t size_max )
 	frame_cache cache = calloc( 1, sizeof( struct frame_cache_s ) );
 	if ( cache != NULL )
 	{
-		cache->frames = mlt_pool_alloc( size_max * sizeof( mlt_frame ) );
-		if ( cache->frames == NULL )
+		if ( pthread_mutex_init( &cache->mutex, NULL ) != 0 )
 		{
 			free( cache );
 			return NULL;
 		}
-		cache->start_pos = 0;
-		cache->frames_total = 0;
-		cache->size = size_max;
+		cache->active = -1;
+		cache->size = 0;
+		cache->size_max = size_max;
+		cache->protected_from = FRAME_CACHE_INVALID_POSITION;
+		cache->protected_to = FRAME_CACHE_INVALID_POSITION;
+
+		pthread_mutex_lock( &global_mutex );
+		cache->next = global_caches;
+		global_caches = cache;
+		pthread_mutex_unlock( &global_mutex );
 	}
 	return cache;
 }
 
+void frame_cache_set_size( frame_cache self, size_t size_max )
+{
+	// Empty budget would make cache useless, so it's ignored like in init
+	if ( self == NULL || size_max == 0 )
+		return;
+
+	pthread_mutex_lock( &self->mutex );
+	self->size_max = size_max;
+	frame_cache_segment victim;
+	while ( self->size > self->size_max && ( victim = frame_cache_victim( self ) ) != NULL )
+		frame_cache_drop_earliest( self, victim );
+	pthread_mutex_unlock( &self->mutex );
+}
+
 mlt_frame frame_cache_get_frame( frame_cache self, mlt_position position )
 {
 	// Return NULL if cache miss/fail
@@ -78,95 +307,133 @@ mlt_frame frame_cache_get_frame( frame_cache self, mlt_position position )
 	if ( self == NULL )
 		return frame;
 
-	if ( self->frames_total > 0 )
-	{
-		ssize_t index = frame_cache_frame_index( self, position );
-		if ( index != -1 )
-			frame = self->frames[ index ];
-	}
+	pthread_mutex_lock( &self->mutex );
 
-	// We managed to get frame from cache, so retain it to share ownership with the client
-	if ( frame != NULL )
+	struct frame_cache_entry_s *entry;
+	frame_cache_segment segment = frame_cache_find( self, position, &entry );
+	if ( segment != NULL )
 	{
+		frame = entry->frame;
+		segment->last_use = frame_cache_time( );
+		// We managed to get frame from cache, so retain it to share ownership with the client
 		mlt_properties_inc_ref( MLT_FRAME_PROPERTIES( frame ) );
 	}
 
+	pthread_mutex_unlock( &self->mutex );
+
 	return frame;
 }
 
-int frame_cache_put_frame( frame_cache self, mlt_frame frame )
+int frame_cache_contains( frame_cache self, mlt_position position )
+{
+	if ( self == NULL )
+		return 0;
+
+	pthread_mutex_lock( &self->mutex );
+	struct frame_cache_entry_s *entry;
+	int contains = frame_cache_find( self, position, &entry ) != NULL;
+	pthread_mutex_unlock( &self->mutex );
+
+	return contains;
+}
+
+void frame_cache_protect( frame_cache self, mlt_position from, mlt_position to )
+{
+	if ( self == NULL )
+		return;
+
+	pthread_mutex_lock( &self->mutex );
+	self->protected_from = from;
+	self->protected_to = to;
+	pthread_mutex_unlock( &self->mutex );
+}
+
+int frame_cache_full( frame_cache self, size_t size )
+{
+	if ( self == NULL )
+		return 0;
+
+	pthread_mutex_lock( &self->mutex );
+	int full = self->size > 0 && self->size + size > self->size_max && frame_cache_victim( self ) == NULL;
+	pthread_mutex_unlock( &self->mutex );
+
+	return full;
+}
+
+int frame_cache_put_frame( frame_cache self, mlt_frame frame, size_t size )
 {
 	if ( self == NULL )
 		return 1;
 
+	pthread_mutex_lock( &self->mutex );
+
 	mlt_position frame_position = mlt_frame_original_position( frame );
-	// We actually need to insert frame into cache
-	if ( frame_cache_frame_index( self, frame_position ) == -1 )
+	frame_cache_segment active = self->active != -1 ? &self->segments[ self->active ] : NULL;
+	struct frame_cache_entry_s *entry;
+
+	// We're trying to insert next frame (in sequence), so it extends active segment
+	if ( active == NULL || active->frames_total == 0 || frame_position != frame_cache_segment_last( active ) + 1 )
 	{
-		if ( self->frames_total > 0 )
+		// Frame we have already isn't stored again
+		if ( frame_cache_find( self, frame_position, &entry ) != NULL )
 		{
-			mlt_frame first_frame = self->frames[ self->start_pos ];
-			mlt_position first_frame_position = mlt_frame_original_position( first_frame );
-			mlt_position last_frame_position = first_frame_position + self->frames_total - 1;
-			// We're trying to insert next frame (in sequence), so no need to delete previous ones
-			if ( frame_position == last_frame_position + 1 )
-			{
-				// Append new frame at the end of circular buffer
-				if ( self->frames_total < self->size )
-				{
-					size_t index = ( self->start_pos + self->frames_total ) % self->size;
-					self->frames[ index ] = frame;
-					self->frames_total += 1;
-				}
-				// We need to throw out the earliest frame
-				else
-				{
-					self->frames[ self->start_pos ] = frame;
-					self->start_pos = ( self->start_pos + 1 ) % self->size;
-				}
-			}
-			// We're inserting frame that is not in cache, and is not next in sequence
-			else
-			{
-				frame_cache_purge( self );
-				self->frames[ self->start_pos ] = frame;
-				self->frames_total += 1;
-			}
+			pthread_mutex_unlock( &self->mutex );
+			return 1;
 		}
-		else
+
+		// Otherwise it starts a new segment, replacing the least recently used one if needed
+		int i;
+		active = NULL;
+		for ( i = 0; i < FRAME_CACHE_MAX_SEGMENTS && active == NULL; i++ )
+			if ( self->segments[ i ].frames_total == 0 )
+				active = &self->segments[ i ];
+		if ( active == NULL )
 		{
-			self->frames[ self->start_pos ] = frame;
-			self->frames_total += 1;
+			self->active = -1;
+			active = frame_cache_victim( self );
+			// Every segment is protected, so frame has nowhere to go
+			if ( active == NULL )
+			{
+				pthread_mutex_unlock( &self->mutex );
+				return 1;
+			}
+			frame_cache_purge_segment( self, active );
 		}
+		self->active = active - self->segments;
 	}
-	return 0;
-}
 
-mlt_position frame_cache_earliest_frame_position( frame_cache self )
-{
-	if ( self == NULL )
-		return FRAME_CACHE_INVALID_POSITION;
-
-	if ( self->frames_total == 0 )
-		return FRAME_CACHE_INVALID_POSITION;
+	if ( active->frames_total == active->capacity && frame_cache_segment_grow( active ) )
+	{
+		pthread_mutex_unlock( &self->mutex );
+		return 1;
+	}
 
-	mlt_frame earliest_frame = self->frames[ self->start_pos ];
+	entry = frame_cache_entry( active, active->frames_total );
+	entry->frame = frame;
+	entry->size = size;
+	active->frames_total++;
+	active->last_use = frame_cache_time( );
+	self->size += size;
 
-	return mlt_frame_original_position( earliest_frame );
-}
+	// Active segment grew into another one, which therefore loses its first frame
+	int i;
+	for ( i = 0; i < FRAME_CACHE_MAX_SEGMENTS; i++ )
+	{
+		frame_cache_segment segment = &self->segments[ i ];
+		if ( segment != active && segment->frames_total > 0 && frame_cache_segment_first( segment ) == frame_position )
+			frame_cache_drop_earliest( self, segment );
+	}
 
-mlt_position frame_cache_latest_frame_position( frame_cache self )
-{
-	if ( self == NULL )
-		return FRAME_CACHE_INVALID_POSITION;
+	// Get back under our own budget
+	frame_cache_segment victim;
+	while ( self->size > self->size_max && ( victim = frame_cache_victim( self ) ) != NULL )
+		frame_cache_drop_earliest( self, victim );
 
-	if ( self->frames_total == 0 )
-		return FRAME_CACHE_INVALID_POSITION;
+	pthread_mutex_unlock( &self->mutex );
 
-	mlt_frame latest_frame =
-		self->frames[ ( self->start_pos + self->frames_total - 1 ) % self->size ];
+	frame_cache_enforce_global_budget( );
 
-	return mlt_frame_original_position( latest_frame );
+	return 0;
 }
 
 void frame_cache_purge( frame_cache self )
@@ -174,14 +441,14 @@ void frame_cache_purge( frame_cache self )
 	if ( self == NULL )
 		return;
 
-	size_t iter;
-	for ( iter = 0; iter < self->frames_total; iter++ )
-	{
-		size_t current_index = ( self->start_pos + iter ) % self->size;
-		mlt_frame_close( self->frames[ current_index ] );
-	}
+	pthread_mutex_lock( &self->mutex );
 
-	self->frames_total = 0;
+	int i;
+	for ( i = 0; i < FRAME_CACHE_MAX_SEGMENTS; i++ )
+		frame_cache_purge_segment( self, &self->segments[ i ] );
+	self->active = -1;
+
+	pthread_mutex_unlock( &self->mutex );
 }
 
 void frame_cache_close( frame_cache self )
@@ -189,7 +456,22 @@ void frame_cache_close( frame_cache self )
 	if ( self == NULL )
 		return;
 
+	pthread_mutex_lock( &global_mutex );
+	frame_cache *iter;
+	for ( iter = &global_caches; *iter != NULL; iter = &( *iter )->next )
+	{
+		if ( *iter == self )
+		{
+			*iter = self->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &global_mutex );
+
 	frame_cache_purge( self );
-	mlt_pool_release( self->frames );
+	int i;
+	for ( i = 0; i < FRAME_CACHE_MAX_SEGMENTS; i++ )
+		free( self->segments[ i ].entries );
+	pthread_mutex_destroy( &self->mutex );
 	free( self );
 }
@@ -7,11 +7,16 @@
 
 typedef struct frame_cache_s *frame_cache;
 
+extern void frame_cache_set_global_size( size_t size_max );
+extern void frame_cache_global_reserve( size_t size );
+extern void frame_cache_global_release( size_t size );
 extern frame_cache frame_cache_init( size_t size_max );
+extern void frame_cache_set_size( frame_cache self, size_t size_max );
 extern mlt_frame frame_cache_get_frame( frame_cache self, mlt_position position );
-extern int frame_cache_put_frame( frame_cache self, mlt_frame frame );
-extern mlt_position frame_cache_earliest_frame_position( frame_cache self );
-extern mlt_position frame_cache_latest_frame_position( frame_cache self );
+extern int frame_cache_contains( frame_cache self, mlt_position position );
+extern void frame_cache_protect( frame_cache self, mlt_position from, mlt_position to );
+extern int frame_cache_full( frame_cache self, size_t size );
+extern int frame_cache_put_frame( frame_cache self, mlt_frame frame, size_t size );
 extern void frame_cache_purge( frame_cache self );
 extern void frame_cache_close( frame_cache self );
 
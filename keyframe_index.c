@@ -0,0 +1,150 @@
+/*
+Keyframe timestamp index.
+
+libVLC doesn't tell us where keyframes are, but with fast seeking
+enabled every seek lands on a keyframe preceding the requested time.
+libVLC producer records the timestamp of each such landing here, so
+the index grows lazily as the resource gets seeked around.
+
+Timestamps are kept sorted (in microseconds of media time), so we can
+answer "where would a seek to this timestamp land" with binary search.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include <framework/mlt_pool.h>
+
+#include "keyframe_index.h"
+
+#define KEYFRAME_INDEX_INITIAL_SIZE 64
+
+struct keyframe_index_s
+{
+	// Sorted array of keyframe timestamps
+	int64_t *timestamps;
+	// How many timestamps are in index currently
+	size_t count;
+	// How many timestamps fit in allocated array
+	size_t size;
+};
+
+// Returns index of first timestamp, which is greater than given one
+static size_t keyframe_index_upper_bound( keyframe_index self, int64_t timestamp )
+{
+	size_t low = 0;
+	size_t high = self->count;
+	while ( low < high )
+	{
+		size_t middle = low + ( high - low ) / 2;
+		if ( self->timestamps[ middle ] <= timestamp )
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+keyframe_index keyframe_index_init( void )
+{
+	keyframe_index index = calloc( 1, sizeof( struct keyframe_index_s ) );
+	if ( index != NULL )
+	{
+		index->timestamps = mlt_pool_alloc( KEYFRAME_INDEX_INITIAL_SIZE * sizeof( int64_t ) );
+		if ( index->timestamps == NULL )
+		{
+			free( index );
+			return NULL;
+		}
+		index->count = 0;
+		index->size = KEYFRAME_INDEX_INITIAL_SIZE;
+	}
+	return index;
+}
+
+int keyframe_index_insert( keyframe_index self, int64_t timestamp )
+{
+	if ( self == NULL || timestamp < 0 )
+		return 1;
+
+	size_t position = keyframe_index_upper_bound( self, timestamp );
+
+	// We already know about this keyframe
+	if ( position > 0 && self->timestamps[ position - 1 ] == timestamp )
+		return 0;
+
+	// Grow the array if it's full
+	if ( self->count == self->size )
+	{
+		int64_t *timestamps = mlt_pool_realloc( self->timestamps, 2 * self->size * sizeof( int64_t ) );
+		if ( timestamps == NULL )
+			return 1;
+		self->timestamps = timestamps;
+		self->size *= 2;
+	}
+
+	memmove( self->timestamps + position + 1, self->timestamps + position,
+			 ( self->count - position ) * sizeof( int64_t ) );
+	self->timestamps[ position ] = timestamp;
+	self->count += 1;
+
+	return 0;
+}
+
+int64_t keyframe_index_preceding( keyframe_index self, int64_t timestamp )
+{
+	if ( self == NULL )
+		return KEYFRAME_INDEX_INVALID_TIMESTAMP;
+
+	size_t position = keyframe_index_upper_bound( self, timestamp );
+	if ( position == 0 )
+		return KEYFRAME_INDEX_INVALID_TIMESTAMP;
+
+	return self->timestamps[ position - 1 ];
+}
+
+int64_t keyframe_index_following( keyframe_index self, int64_t timestamp )
+{
+	if ( self == NULL )
+		return KEYFRAME_INDEX_INVALID_TIMESTAMP;
+
+	size_t position = keyframe_index_upper_bound( self, timestamp );
+	if ( position == self->count )
+		return KEYFRAME_INDEX_INVALID_TIMESTAMP;
+
+	return self->timestamps[ position ];
+}
+
+int64_t keyframe_index_min_interval( keyframe_index self )
+{
+	if ( self == NULL || self->count < 2 )
+		return KEYFRAME_INDEX_INVALID_TIMESTAMP;
+
+	// Index usually doesn't contain every keyframe, so the smallest distance
+	// between neighbouring entries is our best guess for keyframe interval
+	int64_t min_interval = self->timestamps[ 1 ] - self->timestamps[ 0 ];
+	size_t iter;
+	for ( iter = 2; iter < self->count; iter++ )
+	{
+		int64_t interval = self->timestamps[ iter ] - self->timestamps[ iter - 1 ];
+		if ( interval < min_interval )
+			min_interval = interval;
+	}
+	return min_interval;
+}
+
+size_t keyframe_index_count( keyframe_index self )
+{
+	if ( self == NULL )
+		return 0;
+
+	return self->count;
+}
+
+void keyframe_index_close( keyframe_index self )
+{
+	if ( self == NULL )
+		return;
+
+	mlt_pool_release( self->timestamps );
+	free( self );
+}
\ No newline at end of file
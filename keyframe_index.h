@@ -0,0 +1,19 @@
+#ifndef KEYFRAME_INDEX_H
+#define KEYFRAME_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KEYFRAME_INDEX_INVALID_TIMESTAMP (-1)
+
+typedef struct keyframe_index_s *keyframe_index;
+
+extern keyframe_index keyframe_index_init( void );
+extern int keyframe_index_insert( keyframe_index self, int64_t timestamp );
+extern int64_t keyframe_index_preceding( keyframe_index self, int64_t timestamp );
+extern int64_t keyframe_index_following( keyframe_index self, int64_t timestamp );
+extern int64_t keyframe_index_min_interval( keyframe_index self );
+extern size_t keyframe_index_count( keyframe_index self );
+extern void keyframe_index_close( keyframe_index self );
+
+#endif
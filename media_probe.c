@@ -0,0 +1,397 @@
+/*
+Media metadata probing with persistent cache.
+
+VLC parses media asynchronously (libvlc_media_parse_with_options),
+media_probe_parse just waits for it to finish. Producers can instead
+return right away and pick results up from MediaParsedChanged event,
+when module property MLT_LIBVLC_PROBE is "async". Applications set it
+with mlt_environment_set, the process environment is a fallback.
+
+Results are kept in a file keyed by path, size and modification time,
+so reopening a project doesn't parse its media again. The file is
+MLT_LIBVLC_PROBE_CACHE, or libvlc-probe in user's cache directory.
+Each line holds size, mtime, metadata and path. Lines of an older layout
+(fewer metadata fields) don't match, so their media gets parsed again. New results are
+appended, later lines override earlier ones. Once overridden lines
+pile up, the file gets rewritten with entries of files, which still
+exist unchanged, up to MEDIA_PROBE_MAX_ENTRIES of them.
+
+media_probe_batch fills the cache for many files at once, parsing
+them on a pool of worker threads.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <framework/mlt_properties.h>
+#include <framework/mlt_factory.h>
+
+#include "media_probe.h"
+#include "vlc_instance.h"
+
+// How long VLC may parse single media (in milliseconds)
+#define MEDIA_PROBE_TIMEOUT 10000
+// Cache file gets rewritten once it has this many lines more than entries
+#define MEDIA_PROBE_STALE_LINES 1024
+// Rewritten cache file keeps this many entries at most (the latest ones)
+#define MEDIA_PROBE_MAX_ENTRIES 65536
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Entries from cache file by path (NULL until loaded)
+static mlt_properties cache_entries = NULL;
+// Number of lines in cache file
+static int cache_lines = 0;
+
+struct parse_wait_s
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done;
+};
+
+struct batch_s
+{
+	const char **paths;
+	int count;
+	// Next path to probe
+	int next;
+	// Number of paths probed successfully
+	int probed;
+	// Workers stop taking paths once it's set
+	const int *cancel;
+};
+
+static const char *cache_file_path( char *buffer, size_t size )
+{
+	const char *path = getenv( "MLT_LIBVLC_PROBE_CACHE" );
+	if ( path != NULL )
+		return path;
+
+	const char *dir = getenv( "XDG_CACHE_HOME" );
+	if ( dir != NULL )
+	{
+		snprintf( buffer, size, "%s/libvlc-probe", dir );
+		return buffer;
+	}
+
+	dir = getenv( "HOME" );
+	if ( dir == NULL )
+		return NULL;
+	snprintf( buffer, size, "%s/.cache", dir );
+	mkdir( buffer, 0700 );
+	snprintf( buffer, size, "%s/.cache/libvlc-probe", dir );
+	return buffer;
+}
+
+// WARNING: Lock cache_mutex before calling this function
+static void cache_load( )
+{
+	if ( cache_entries != NULL )
+		return;
+
+	cache_entries = mlt_properties_new( );
+	if ( cache_entries == NULL )
+		return;
+
+	char buffer[ PATH_MAX ];
+	const char *path = cache_file_path( buffer, sizeof( buffer ) );
+	FILE *file = path != NULL ? fopen( path, "r" ) : NULL;
+	if ( file == NULL )
+		return;
+
+	// Path follows fixed fields after a single space
+	char line[ PATH_MAX + 256 ];
+	while ( fgets( line, sizeof( line ), file ) )
+	{
+		cache_lines++;
+		line[ strcspn( line, "\n" ) ] = '\0';
+		char *media_path = line;
+		int field;
+		for ( field = 0; field < 11 && media_path != NULL; field++ )
+		{
+			media_path = strchr( media_path, ' ' );
+			if ( media_path != NULL )
+				media_path++;
+		}
+		if ( media_path == NULL || *media_path == '\0' )
+			continue;
+
+		media_path[ -1 ] = '\0';
+		mlt_properties_set( cache_entries, media_path, line );
+	}
+
+	fclose( file );
+}
+
+// Rewrites cache file with entries of files, which still exist unchanged.
+// New file replaces the old one only once it's complete.
+// WARNING: Lock cache_mutex before calling this function
+static void cache_compact( const char *cache_path )
+{
+	char temp_path[ PATH_MAX ];
+	snprintf( temp_path, sizeof( temp_path ), "%s.tmp", cache_path );
+
+	mlt_properties entries = mlt_properties_new( );
+	FILE *file = entries != NULL ? fopen( temp_path, "w" ) : NULL;
+	if ( file == NULL )
+	{
+		mlt_properties_close( entries );
+		return;
+	}
+
+	int count = mlt_properties_count( cache_entries );
+	int first = count > MEDIA_PROBE_MAX_ENTRIES ? count - MEDIA_PROBE_MAX_ENTRIES : 0;
+	int error = 0;
+	int i;
+	for ( i = first; i < count; i++ )
+	{
+		char *path = mlt_properties_get_name( cache_entries, i );
+		char *entry = mlt_properties_get_value( cache_entries, i );
+		struct stat st;
+		long long size = -1, mtime = -1;
+		if ( path == NULL || entry == NULL || stat( path, &st ) ||
+			 sscanf( entry, "%lld %lld", &size, &mtime ) != 2 ||
+			 size != ( long long )st.st_size || mtime != ( long long )st.st_mtime )
+			continue;
+
+		mlt_properties_set( entries, path, entry );
+		error |= fprintf( file, "%s %s\n", entry, path ) < 0;
+	}
+	error |= fclose( file ) != 0;
+
+	if ( error || rename( temp_path, cache_path ) )
+	{
+		remove( temp_path );
+		mlt_properties_close( entries );
+		return;
+	}
+
+	mlt_properties_close( cache_entries );
+	cache_entries = entries;
+	cache_lines = mlt_properties_count( entries );
+}
+
+int media_probe_async_enabled( void )
+{
+	const char *mode = mlt_environment( "MLT_LIBVLC_PROBE" );
+	if ( mode == NULL )
+		mode = getenv( "MLT_LIBVLC_PROBE" );
+	return mode != NULL && !strcmp( mode, "async" );
+}
+
+// Returns 0 if path was found in cache and hasn't changed since
+int media_probe_lookup( const char *path, media_info info )
+{
+	struct stat st;
+	if ( path == NULL || stat( path, &st ) )
+		return 1;
+
+	pthread_mutex_lock( &cache_mutex );
+	cache_load( );
+	char *entry = cache_entries != NULL ? mlt_properties_get( cache_entries, path ) : NULL;
+	long long size = -1, mtime = -1, duration = 0;
+	int fields = 0;
+	if ( entry != NULL )
+		fields = sscanf( entry, "%lld %lld %d %d %d %d %d %d %u %d %lld", &size, &mtime,
+			&info->width, &info->height, &info->frame_rate_num, &info->frame_rate_den,
+			&info->sample_aspect_num, &info->sample_aspect_den, &info->codec, &info->profile, &duration );
+	pthread_mutex_unlock( &cache_mutex );
+	info->duration = duration;
+
+	return fields != 11 || size != ( long long )st.st_size || mtime != ( long long )st.st_mtime;
+}
+
+void media_probe_store( const char *path, media_info info )
+{
+	struct stat st;
+	if ( path == NULL || stat( path, &st ) || strchr( path, '\n' ) )
+		return;
+
+	char entry[ 256 ];
+	snprintf( entry, sizeof( entry ), "%lld %lld %d %d %d %d %d %d %u %d %lld",
+		( long long )st.st_size, ( long long )st.st_mtime,
+		info->width, info->height, info->frame_rate_num, info->frame_rate_den,
+		info->sample_aspect_num, info->sample_aspect_den, info->codec, info->profile,
+		( long long )info->duration );
+
+	pthread_mutex_lock( &cache_mutex );
+	cache_load( );
+	if ( cache_entries != NULL )
+		mlt_properties_set( cache_entries, path, entry );
+
+	char buffer[ PATH_MAX ];
+	const char *cache_path = cache_file_path( buffer, sizeof( buffer ) );
+	FILE *file = cache_path != NULL ? fopen( cache_path, "a" ) : NULL;
+	if ( file != NULL )
+	{
+		fprintf( file, "%s %s\n", entry, path );
+		fclose( file );
+		cache_lines++;
+
+		// Lines overridden (or entries over the limit) are rewritten in bulk
+		if ( cache_entries != NULL && ( cache_lines - mlt_properties_count( cache_entries ) > MEDIA_PROBE_STALE_LINES ||
+			 mlt_properties_count( cache_entries ) > MEDIA_PROBE_MAX_ENTRIES + MEDIA_PROBE_STALE_LINES ) )
+			cache_compact( cache_path );
+	}
+	pthread_mutex_unlock( &cache_mutex );
+}
+
+// Reads duration and metadata of first video track of parsed media
+void media_probe_read_tracks( libvlc_media_t *media, media_info info )
+{
+	memset( info, 0, sizeof( struct media_info_s ) );
+
+	libvlc_time_t duration = libvlc_media_get_duration( media );
+	info->duration = duration > 0 ? duration : 0;
+
+	libvlc_media_track_t **tracks;
+	unsigned int nb_tracks = libvlc_media_tracks_get( media, &tracks );
+	unsigned int track_i;
+
+	for ( track_i = 0; track_i < nb_tracks; track_i++ )
+	{
+		libvlc_media_track_t *track = tracks[ track_i ];
+
+		// We pick first video track as the default one
+		if ( track->i_type == libvlc_track_video )
+		{
+			libvlc_video_track_t *v_track = track->video;
+			info->width = v_track->i_width;
+			info->height = v_track->i_height;
+			info->frame_rate_num = v_track->i_frame_rate_num;
+			info->frame_rate_den = v_track->i_frame_rate_den;
+			info->sample_aspect_num = v_track->i_sar_num;
+			info->sample_aspect_den = v_track->i_sar_den;
+			info->codec = track->i_codec;
+			info->profile = track->i_profile;
+			break;
+		}
+	}
+	libvlc_media_tracks_release( tracks, nb_tracks );
+}
+
+// Starts parsing media in VLC's background thread, completion is signalled
+// by libvlc_MediaParsedChanged event
+int media_probe_start( libvlc_media_t *media )
+{
+	return libvlc_media_parse_with_options( media, libvlc_media_parse_local, MEDIA_PROBE_TIMEOUT );
+}
+
+static void parse_wait_event( const struct libvlc_event_t *event, void *data )
+{
+	struct parse_wait_s *wait = data;
+
+	pthread_mutex_lock( &wait->mutex );
+	wait->done = 1;
+	pthread_cond_signal( &wait->cond );
+	pthread_mutex_unlock( &wait->mutex );
+}
+
+// Parses media and waits for the result. Returns 0 on success.
+int media_probe_parse( libvlc_media_t *media, media_info info )
+{
+	struct parse_wait_s wait;
+	pthread_mutex_init( &wait.mutex, NULL );
+	pthread_cond_init( &wait.cond, NULL );
+	wait.done = 0;
+
+	libvlc_event_manager_t *events = libvlc_media_event_manager( media );
+	libvlc_event_attach( events, libvlc_MediaParsedChanged, parse_wait_event, &wait );
+
+	int error = media_probe_start( media );
+	if ( !error )
+	{
+		// Media parsed before doesn't get parsed (nor signalled) again
+		pthread_mutex_lock( &wait.mutex );
+		while ( !wait.done && libvlc_media_get_parsed_status( media ) == 0 )
+			pthread_cond_wait( &wait.cond, &wait.mutex );
+		pthread_mutex_unlock( &wait.mutex );
+		error = libvlc_media_get_parsed_status( media ) != libvlc_media_parsed_status_done;
+	}
+
+	// Detaching waits for event handler to return
+	libvlc_event_detach( events, libvlc_MediaParsedChanged, parse_wait_event, &wait );
+	pthread_cond_destroy( &wait.cond );
+	pthread_mutex_destroy( &wait.mutex );
+
+	if ( !error )
+		media_probe_read_tracks( media, info );
+	return error;
+}
+
+// Probes file, using cache if possible. Returns 0 on success.
+int media_probe_path( const char *path, media_info info )
+{
+	if ( !media_probe_lookup( path, info ) )
+		return 0;
+
+	libvlc_instance_t *vlc = vlc_instance_acquire( );
+	if ( vlc == NULL )
+		return 1;
+
+	int error = 1;
+	libvlc_media_t *media = libvlc_media_new_path( vlc, path );
+	if ( media != NULL )
+	{
+		error = media_probe_parse( media, info );
+		if ( !error )
+			media_probe_store( path, info );
+		libvlc_media_release( media );
+	}
+
+	vlc_instance_release( vlc );
+	return error;
+}
+
+static void *batch_worker( void *data )
+{
+	struct batch_s *batch = data;
+	struct media_info_s info;
+
+	int index;
+	while ( ( index = __atomic_fetch_add( &batch->next, 1, __ATOMIC_RELAXED ) ) < batch->count )
+	{
+		if ( batch->cancel != NULL && __atomic_load_n( batch->cancel, __ATOMIC_ACQUIRE ) )
+			break;
+
+		if ( !media_probe_path( batch->paths[ index ], &info ) )
+			__atomic_fetch_add( &batch->probed, 1, __ATOMIC_RELAXED );
+	}
+
+	return NULL;
+}
+
+// Probes many files into cache on a pool of worker threads, so opening them
+// later doesn't parse them. Files not started yet are skipped once cancel (if
+// not NULL) gets set. Returns number of files probed successfully.
+int media_probe_batch( const char **paths, int count, int workers, const int *cancel )
+{
+	struct batch_s batch = { paths, count, 0, 0, cancel };
+
+	if ( workers < 1 )
+		workers = 1;
+	if ( workers > count )
+		workers = count;
+
+	pthread_t *threads = calloc( workers, sizeof( pthread_t ) );
+	if ( threads == NULL )
+		workers = 0;
+
+	int started = 0;
+	while ( started < workers && !pthread_create( &threads[ started ], NULL, batch_worker, &batch ) )
+		started++;
+
+	// Without worker threads, we do the work ourselves
+	if ( started == 0 )
+		batch_worker( &batch );
+
+	int i;
+	for ( i = 0; i < started; i++ )
+		pthread_join( threads[ i ], NULL );
+	free( threads );
+
+	return batch.probed;
+}
@@ -0,0 +1,33 @@
+#ifndef MEDIA_PROBE_H
+#define MEDIA_PROBE_H
+
+#include <stdint.h>
+#include <vlc/vlc.h>
+
+struct media_info_s
+{
+	int width;
+	int height;
+	int frame_rate_num;
+	int frame_rate_den;
+	int sample_aspect_num;
+	int sample_aspect_den;
+	// Fourcc and profile of video codec (raw codecs are chromas themselves)
+	unsigned int codec;
+	int profile;
+	// Duration of media in milliseconds (0 if unknown)
+	int64_t duration;
+};
+
+typedef struct media_info_s *media_info;
+
+extern int media_probe_async_enabled( void );
+extern int media_probe_lookup( const char *path, media_info info );
+extern void media_probe_store( const char *path, media_info info );
+extern void media_probe_read_tracks( libvlc_media_t *media, media_info info );
+extern int media_probe_start( libvlc_media_t *media );
+extern int media_probe_parse( libvlc_media_t *media, media_info info );
+extern int media_probe_path( const char *path, media_info info );
+extern int media_probe_batch( const char **paths, int count, int workers, const int *cancel );
+
+#endif
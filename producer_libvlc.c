@@ -8,14 +8,87 @@
 #include <string.h>
 #include <assert.h>
 #include <locale.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
 
 #include "frame_cache.h"
 #include "buffer_queue.h"
-
-#define SEEK_THRESHOLD 25
+#include "slab_pool.h"
+#include "spsc_queue.h"
+#include "vlc_instance.h"
+#include "media_probe.h"
+#include "thumbnailer.h"
+#include "shared_cache.h"
+#include "keyframe_index.h"
+#include "waveform.h"
+
+// Until we measure real costs, seek is assumed to cost as much as decoding this many frames
+#define SEEK_COST_INITIAL_FRAMES 25
+// Weights of new measurements in running averages of decode and seek costs
+#define DECODE_TIME_WEIGHT 0.05
+#define SEEK_LATENCY_WEIGHT 0.25
+// Capacities of queues handing decoded data over to packer thread
+#define AUDIO_QUEUE_CAPACITY 256
+#define VIDEO_QUEUE_CAPACITY 64
+// Frames past out point decoded ahead of requests, in case MLT asks for them
+#define OUT_POINT_MARGIN 5
 
 typedef struct producer_libvlc_s *producer_libvlc;
 
+// What VLC threads hand over to packer thread
+enum decoded_type
+{
+	DECODED_AUDIO,
+	DECODED_VIDEO
+};
+
+struct decoded_item_s
+{
+	enum decoded_type type;
+	// Buffer is NULL for pictures VLC had no buffer of ours for
+	uint8_t *buffer;
+	size_t size;
+	// Stream timestamp of the picture or the first sample (in microseconds)
+	int64_t pts;
+	// Duration of audio (in microseconds)
+	int64_t duration;
+	// VLC clock date, when VLC handed the item over
+	int64_t clock;
+	// Time VLC took to decode picture (0 if unknown)
+	int64_t decode_time;
+	// Picture format
+	mlt_image_format vfmt;
+	int width;
+	int height;
+};
+
+typedef struct decoded_item_s *decoded_item;
+
+// Thread waiting in producer_get_frame for a frame to get into cache
+struct frame_waiter_s
+{
+	mlt_position position;
+	pthread_cond_t cond;
+	struct frame_waiter_s *next;
+};
+
+typedef struct frame_waiter_s *frame_waiter;
+
+// Batch mode lane, producer of its own, which decodes every lane_count-th
+// segment of in/out range with its own media player
+struct batch_lane_s
+{
+	mlt_producer producer;
+	// Requests to lane are served one at a time (they move its position)
+	pthread_mutex_t mutex;
+	// Segment lane decodes (-1 if none yet, protected by parent's cache_mutex)
+	int segment;
+};
+
+typedef struct batch_lane_s *batch_lane;
+
 struct producer_libvlc_s
 {
 	mlt_producer parent;
@@ -25,75 +98,185 @@ struct producer_libvlc_s
 
 	// Flag for cleanup
 	int terminating;
+	// Media is being parsed in background
+	int media_parse_pending;
+	// VLC doesn't decode video, frames are timed by audio
+	int audio_only;
+	// VLC doesn't decode audio, frames are packed from pictures alone
+	int video_only;
+	// Pictures are decoded at 1/proxy_scale of profile size
+	int proxy_scale;
+	// Decoder lowres level media has an option for (-1 for none)
+	int media_lowres;
+	// Thumbnail mode (libvlc_thumbnails) delivers strips of thumbnails instead of frames
+	int thumbnails;
+	thumbnailer thumbnailer;
+	// Media player is running (producers start on first request and after hibernation)
+	int started;
+	// Media player is being stopped for hibernation
+	int stopping;
+	// Shared cache knows we're decoding under _shared_cache_key
+	int shared_cache_registered;
+	// Signalled (with cache_mutex), once hibernated media player got released
+	pthread_cond_t stopped_cond;
+	// Wall clock time of the latest get_frame
+	int64_t latest_request_time;
 
 	buffer_queue bqueue;
 	frame_cache cache;
 	pthread_mutex_t cache_mutex;
-	pthread_cond_t cache_cond;
 	int64_t seek_request_timestamp;
 	mlt_position seek_request_position;
 	int during_seek;
-	mlt_position smem_position;
-
-	// This is for holding VLC buffer metadata while it's running
-	unsigned int channels;
+	mlt_position decoder_position;
+
+	// Media time (in microseconds) we are seeking to
+	int64_t seek_request_pts;
+	// Set once VLC has started delivering data from after the seek
+	int seek_landed;
+	// Number of pictures decoded between keyframe landing and seek target
+	int seek_decoded_frames;
+	// VLC clock date of the latest seek, anything VLC handed over earlier predates it
+	int64_t seek_clock;
+	// Set until audio preceding seek_request_pts is thrown away
+	int audio_trim_pending;
+
+	// Timestamps of keyframes, where VLC landed after seeks
+	keyframe_index kf_index;
+	// Stream timestamp of media time zero (-1 until decoder starts at the beginning)
+	int64_t pts_origin;
+	// Media time of the latest picture (or audio in audio only mode) and of its end
+	int64_t latest_pts;
+	int64_t latest_end_pts;
+	// Set while we keep VLC paused, because frame cache is full
+	int paused;
+
+	// Measured costs (in microseconds) used to choose between seeking and decoding forward
+	double frame_decode_time;
+	double seek_latency;
+	// Cleared when seek or pause makes decode time of next picture meaningless
+	int decode_time_valid;
+	// Wall clock time of the pending seek request
+	int64_t seek_start_time;
+
+	// Recycled video buffers
+	slab_pool video_pool;
+	// VLC decodes into this one when video pool can't give us a buffer,
+	// pictures in it are dropped (owned by VLC video thread)
+	uint8_t *fallback_buffer;
+	size_t fallback_size;
+
+	// Decoder stops after packing this position (-1 if it doesn't)
+	mlt_position decode_stop_position;
+	// Nothing past this position is decoded ahead of requests (out point plus margin)
+	mlt_position decode_out_position;
+	// Producer is ready once this position is packed (-1 unless prerolling)
+	mlt_position preroll_position;
+	// Set when packer thread is to fire producer-ready
+	int ready_pending;
+	// Set from preroll until the first request, producer doesn't hibernate meanwhile
+	int prerolled;
+	// Set while VLC decodes chunks for reverse playback
+	int reverse;
+	// Position MLT requested last time
+	mlt_position latest_request_position;
+	// Position MLT is expected to request next (after the latest request)
+	mlt_position next_request_position;
+
+	// VLC threads never take cache_mutex, they push decoded data into these
+	// queues and wake packer thread, which assembles frames
+	spsc_queue audio_queue;
+	spsc_queue video_queue;
+	pthread_t packer_thread;
+	int packer_started;
+	pthread_mutex_t packer_mutex;
+	pthread_cond_t packer_cond;
+	int packer_pending;
+	// Threads waiting for frames (protected by cache_mutex)
+	frame_waiter waiters;
+	// Signalled (with cache_mutex), once the last waiter left closing producer
+	pthread_cond_t waiters_cond;
+
+	// Set by VLC event thread, once media player got to the end of media
+	int end_reached;
+	// Set by packer thread, once everything decoded up to the end is packed.
+	// Ended media player doesn't seek anymore.
+	int ended;
+	// First position past the end of media (-1 until decoder gets there)
+	mlt_position end_position;
+
+	// Picture format VLC decodes into (fixed while media player runs)
+	mlt_image_format video_format;
+	// Size of buffers video pool hands out (owned by VLC video thread)
+	size_t video_buffer_size;
+	// Wall clock time of the latest video_postrender_callback return (owned by VLC video thread)
+	int64_t latest_video_return;
+
+	// Batch mode lanes (NULL unless batch_lanes is set)
+	batch_lane lanes;
+	int lane_count;
+	int segment_size;
+
+	// Thread generating peak file of waveform_file
+	pthread_t waveform_thread;
+	int waveform_started;
+	int waveform_cancel;
+
+	// Thread probing probe_files into media probe cache
+	pthread_t probe_thread;
+	int probe_started;
+	int probe_cancel;
 };
 
-static void log_cb( void *data, int vlc_level, const libvlc_log_t *ctx, const char *fmt, va_list args )
-{
-	if ( data == NULL )
-		return;
-
-	producer_libvlc self = data;
-
-	int mlt_level;
-	switch ( vlc_level )
-	{
-		case LIBVLC_DEBUG:
-			mlt_level = MLT_LOG_DEBUG;
-			break;
-		case LIBVLC_NOTICE:
-			mlt_level = MLT_LOG_INFO;
-			break;
-		case LIBVLC_WARNING:
-			mlt_level = MLT_LOG_WARNING;
-			break;
-		case LIBVLC_ERROR:
-		default:
-			mlt_level = MLT_LOG_FATAL;
-	}
-
-	// In order to get readable output from MLT default log handler,
-	// we need to end our message with newline, VLC doesn't do that
-	size_t fmt_len = strlen( fmt );
-	// + \n + \0
-	char *fmt_nl = calloc( fmt_len + 1 + 1, sizeof( char ) );
-	if ( fmt_nl == NULL )
-		return;
-
-	strcat( fmt_nl, fmt );
-	strcat( fmt_nl, "\n" );
-
-	mlt_vlog( MLT_PRODUCER_SERVICE( self->parent ), mlt_level, fmt_nl, args );
-
-	free( fmt_nl );
-}
-
 // Forward references
 static int producer_get_frame( mlt_producer producer, mlt_frame_ptr frame, int index );
+static int producer_get_strip( mlt_producer producer, mlt_frame_ptr frame, int index );
+static int producer_get_batch_frame( mlt_producer producer, mlt_frame_ptr frame_ptr, int index );
+static int producer_get_strip_image( mlt_frame frame, uint8_t **buffer, mlt_image_format *format, int *width, int *height, int writable );
 static void collect_stream_data( producer_libvlc self );
-static int setup_smem( producer_libvlc self );
+static void set_stream_data( producer_libvlc self, media_info info );
+static void media_parsed_callback( const struct libvlc_event_t *event, void *data );
+static void media_player_end_callback( const struct libvlc_event_t *event, void *data );
+static void setup_properties( producer_libvlc self );
+static void setup_smem( producer_libvlc self );
 static void producer_close( mlt_producer parent );
-static void audio_prerender_callback( void* p_audio_data, uint8_t** pp_pcm_buffer, size_t size );
-static void audio_postrender_callback( void* p_audio_data, uint8_t* p_pcm_buffer, unsigned int channels,
-									   unsigned int rate, unsigned int nb_samples, unsigned int bits_per_sample,
-									   size_t size, int64_t pts );
-static void video_prerender_callback( void *data, uint8_t **p_buffer, size_t size );
+static void audio_prerender_callback( void *data, uint8_t **buffer, size_t size );
+static void audio_postrender_callback( void *data, uint8_t *buffer, unsigned int channels, unsigned int rate,
+									   unsigned int nb_samples, unsigned int bits_per_sample, size_t size, int64_t pts );
+static void video_prerender_callback( void *data, uint8_t **buffer, size_t size );
 static void video_postrender_callback( void *data, uint8_t *buffer, int width, int height,
 									   int bpp, size_t size, int64_t pts );
 static int setup_vlc( producer_libvlc self );
 static void cleanup_vlc( producer_libvlc self );
-static void smem_pack_frames_or_block( producer_libvlc self );
+static int decoder_pack_frames( producer_libvlc self );
+static void decoder_throttle( producer_libvlc self, int cache_full );
+static void decoder_set_pts_origin( producer_libvlc self, int64_t pts );
+static int64_t decoder_media_time( producer_libvlc self, int64_t pts );
+static void decoder_seek_progress( producer_libvlc self, int64_t pts, int64_t duration );
+static void decoder_seek( producer_libvlc self, mlt_position position, mlt_position stop_position, int reverse );
+static void decoder_request( producer_libvlc self, mlt_position position, int reverse );
+static void decoder_prefetch( producer_libvlc self, mlt_position start, mlt_position end );
+static void producer_preroll( producer_libvlc self, int count );
+static void producer_property_changed( mlt_service owner, producer_libvlc self, char *name );
+static int batch_start( producer_libvlc self );
+static void batch_close( producer_libvlc self );
+static void waveform_start( producer_libvlc self );
+static void waveform_stop( producer_libvlc self );
+static void probe_start( producer_libvlc self );
+static void probe_stop( producer_libvlc self );
+static int64_t wall_clock_time( void );
+static int producer_read_ahead( producer_libvlc self );
+static int seek_is_cheaper( producer_libvlc self, mlt_position position, mlt_position decoded_position );
+static mlt_position requests_window_start( producer_libvlc self, mlt_position position );
+static mlt_position requests_window_end( producer_libvlc self );
+static void *packer_thread( void *data );
+static void decoder_end( producer_libvlc self );
+static int decoder_start( producer_libvlc self, mlt_position position );
+static libvlc_media_player_t *decoder_hibernate( producer_libvlc self );
+static void decoder_release( producer_libvlc self, libvlc_media_player_t *media_player );
+static void packer_wake( producer_libvlc self );
+static void packer_push( producer_libvlc self, spsc_queue queue, decoded_item item );
+static void packer_release( decoded_item item );
 
 mlt_producer producer_libvlc_init( mlt_profile profile, mlt_service_type type, const char *id, char *file )
 {
@@ -128,29 +311,87 @@ mlt_producer producer_libvlc_init( mlt_profile profile, mlt_service_type type, c
 	mlt_properties_set( MLT_PRODUCER_PROPERTIES( producer ), "resource", file );
 	mlt_properties_set_data( MLT_PRODUCER_PROPERTIES( producer ), "_profile", profile, 0, NULL, NULL );
 	mlt_properties_set_double( MLT_PRODUCER_PROPERTIES( producer ), "aspect_ratio", mlt_profile_sar( profile ) );
-	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "frame_cache_size", 25 );
+	// Frame cache memory budget (in bytes)
+	mlt_properties_set_int64( MLT_PRODUCER_PROPERTIES( producer ), "frame_cache_size", 256 * 1024 * 1024 );
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "read_ahead", 25 );
+	// Reverse playback decodes chunks of this many frames
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "reverse_chunk_size", 25 );
+	// Enough idle video buffers to refill the whole cache without allocating
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "video_pool_size", 32 );
+	// Producers not asked for frames this long (in seconds) release their media player and cache
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "idle_timeout", 30 );
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "audio_only", 0 );
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "video_only", 0 );
+	// Interactive preview may decode at 1/2, 1/4 or 1/8 of profile size
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "proxy_scale", 1 );
 	// This is needed because VLC uses dot as floating point separator
 	mlt_properties_set_lcnumeric( MLT_PRODUCER_PROPERTIES( producer ), "C" );
 	// Default audio settings
 	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "channels", 2 );
 	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "frequency", 48000 );
+	// Seek statistics
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "seek_count", 0 );
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "decode_forward_count", 0 );
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "superseded_seek_count", 0 );
+	// Thumbnail strip settings (height 0 follows media aspect ratio)
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "thumbnail_count", 10 );
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "thumbnail_width", 160 );
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "thumbnail_height", 0 );
+	// Batch mode (for renders) decodes segments of this many frames on several media players
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "batch_lanes", 0 );
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "batch_segment_size", 50 );
+	// Setting preroll starts decoding before the first request (0 waits for it)
+	mlt_properties_set_int( MLT_PRODUCER_PROPERTIES( producer ), "preroll", 0 );
 
 	// Set libVLC's producer parent
 	self->parent = producer;
+	self->media_lowres = -1;
 
 	// Set destructor
 	producer->close = producer_close;
 
 	// Override virtual function for getting frames
-	producer->get_frame = producer_get_frame;
+	if ( id != NULL && !strcmp( id, "libvlc_thumbnails" ) )
+	{
+		self->thumbnails = 1;
+		producer->get_frame = producer_get_strip;
+	}
+	else
+	{
+		producer->get_frame = producer_get_frame;
+	}
 
 	// Initialize mutexes and conds
 	pthread_mutex_init( &self->cache_mutex, NULL );
-	pthread_cond_init( &self->cache_cond, NULL );
+	pthread_mutex_init( &self->packer_mutex, NULL );
+	pthread_cond_init( &self->packer_cond, NULL );
+	pthread_cond_init( &self->stopped_cond, NULL );
+	pthread_cond_init( &self->waiters_cond, NULL );
+
+	// We don't know any timestamps yet
+	self->pts_origin = -1;
+	self->latest_pts = -1;
+
+	self->decode_stop_position = -1;
+	self->preroll_position = -1;
+	self->latest_request_position = -1;
+	self->end_position = -1;
+	self->next_request_position = 0;
+
+	// Cost model starts with real-time decoding assumption
+	self->frame_decode_time = 1000000.0 / mlt_profile_fps( profile );
+	self->seek_latency = SEEK_COST_INITIAL_FRAMES * self->frame_decode_time;
 
 	// Initialize all neded VLC objects (or cleanup on fail)
 	if ( setup_vlc( self ) ) goto cleanup;
 
+	// Fired once preroll is in cache (from packer thread)
+	mlt_events_register( MLT_PRODUCER_PROPERTIES( producer ), "producer-ready", NULL );
+	// Fired once peak file of waveform_file is written (from waveform thread)
+	mlt_events_register( MLT_PRODUCER_PROPERTIES( producer ), "waveform-ready", NULL );
+	mlt_events_listen( MLT_PRODUCER_PROPERTIES( producer ), self, "property-changed",
+		( mlt_listener )producer_property_changed );
+
 	return producer;
 
 cleanup:
@@ -174,13 +415,10 @@ static int setup_vlc( producer_libvlc self )
 	if ( file == NULL )
 		return 1;
 
-	// Initialize VLC instance
-	self->vlc = libvlc_new( 0, NULL );
+	// VLC instance is shared by all libvlc services in process
+	self->vlc = vlc_instance_acquire( );
 	if ( self->vlc == NULL ) goto cleanup;
 
-	// Pass logs to MLT
-	libvlc_log_set( self->vlc, log_cb, self );
-
 	// Initialize VLC media
 	self->media = libvlc_media_new_path( self->vlc, file );
 	if ( self->media == NULL ) goto cleanup;
@@ -188,16 +426,13 @@ static int setup_vlc( producer_libvlc self )
 	// Collect stream metadata
 	collect_stream_data( self );
 
-	// Setup libVLC smem
-	if ( setup_smem( self ) ) goto cleanup;
+	// Snapshot properties VLC will be using
+	setup_properties( self );
 
-	// Create smem media player
-	self->media_player = libvlc_media_player_new_from_media( self->media );
-	if ( self->media_player == NULL ) goto cleanup;
+	// Seek straight to keyframes, we decode forward to the exact frame ourselves
+	libvlc_media_add_option( self->media, ":input-fast-seek" );
 
-	// Release media now, that we don't need it
-	libvlc_media_release( self->media );
-	self->media = NULL;
+	// Media player gets created on first request, media is kept for that
 
 	// Create buffer_queue and frame_cache
 	if ( self->bqueue == NULL )
@@ -206,7 +441,8 @@ static int setup_vlc( producer_libvlc self )
 		mlt_audio_format afmt = mlt_properties_get_int( properties, "_mlt_audio_format" );
 		int channels = mlt_properties_get_int( properties, "_channels" );
 		int samplerate = mlt_properties_get_int( properties, "_frequency" );
-		self->bqueue = buffer_queue_init( MLT_PRODUCER_SERVICE( self->parent ), vfmt, afmt, channels, samplerate );
+		double fps = mlt_properties_get_double( properties, "_fps" );
+		self->bqueue = buffer_queue_init( MLT_PRODUCER_SERVICE( self->parent ), fps, vfmt, afmt, channels, samplerate );
 		if ( self->bqueue == NULL ) goto cleanup;
 	}
 	else
@@ -216,24 +452,43 @@ static int setup_vlc( producer_libvlc self )
 
 	if ( self->cache == NULL )
 	{
-		int frame_cache_size = mlt_properties_get_int( properties, "frame_cache_size" );
-		mlt_properties_set_int( properties, "_frame_cache_size", frame_cache_size );
-		self->cache = frame_cache_init( frame_cache_size );
+		// Budgets get applied again whenever decoder starts
+		self->cache = frame_cache_init( mlt_properties_get_int64( properties, "frame_cache_size" ) );
 		if ( self->cache == NULL ) goto cleanup;
+		frame_cache_protect( self->cache, 0, producer_read_ahead( self ) );
 	}
 	else
 	{
 		frame_cache_purge( self->cache );
 	}
 
-	// Start smem
-	libvlc_media_player_play( self->media_player );
+	if ( self->audio_queue == NULL )
+		self->audio_queue = spsc_queue_init( sizeof( struct decoded_item_s ), AUDIO_QUEUE_CAPACITY );
+	if ( self->video_queue == NULL )
+		self->video_queue = spsc_queue_init( sizeof( struct decoded_item_s ), VIDEO_QUEUE_CAPACITY );
+	if ( self->audio_queue == NULL || self->video_queue == NULL ) goto cleanup;
+
+	// Keyframe index stays valid as long as we play the same resource
+	if ( self->kf_index == NULL )
+	{
+		self->kf_index = keyframe_index_init( );
+		if ( self->kf_index == NULL ) goto cleanup;
+	}
 
 	// All went well
 	return 0;
 
 cleanup:
-	if ( self->bqueue ) buffer_queue_close( self->bqueue );
+	buffer_queue_close( self->bqueue );
+	self->bqueue = NULL;
+	frame_cache_close( self->cache );
+	self->cache = NULL;
+	spsc_queue_close( self->audio_queue );
+	self->audio_queue = NULL;
+	spsc_queue_close( self->video_queue );
+	self->video_queue = NULL;
+	keyframe_index_close( self->kf_index );
+	self->kf_index = NULL;
 	cleanup_vlc( self );
 	return 1;
 }
@@ -243,23 +498,72 @@ static void cleanup_vlc( producer_libvlc self )
 	if ( self == NULL )
 		return;
 
-	if ( self->vlc )
+	if ( self->media_player )
 	{
-		libvlc_release( self->vlc );
-		self->vlc = NULL;
+		vlc_instance_log_unregister( self->media_player );
+		libvlc_media_player_release( self->media_player );
+		self->media_player = NULL;
 	}
 	if ( self->media )
 	{
+		// Detaching waits for parsed callback to return
+		if ( self->media_parse_pending )
+		{
+			libvlc_media_parse_stop( self->media );
+			libvlc_event_detach( libvlc_media_event_manager( self->media ), libvlc_MediaParsedChanged,
+								 media_parsed_callback, self );
+			self->media_parse_pending = 0;
+		}
 		libvlc_media_release( self->media );
 		self->media = NULL;
 	}
-	if ( self->media_player )
+	if ( self->vlc )
 	{
-		libvlc_media_player_release( self->media_player );
-		self->media_player = NULL;
+		vlc_instance_release( self->vlc );
+		self->vlc = NULL;
 	}
 }
 
+static void set_stream_data( producer_libvlc self, media_info info )
+{
+	mlt_properties p = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	// This sets metadata, which can be useful for creating auto-profile
+	mlt_properties_set_int( p, "meta.media.width", info->width );
+	mlt_properties_set_int( p, "meta.media.height", info->height );
+	mlt_properties_set_int( p, "meta.media.frame_rate_num", info->frame_rate_num );
+	mlt_properties_set_int( p, "meta.media.frame_rate_den", info->frame_rate_den );
+	mlt_properties_set_int( p, "meta.media.sample_aspect_num", info->sample_aspect_num );
+	mlt_properties_set_int( p, "meta.media.sample_aspect_den", info->sample_aspect_den );
+
+	// Picks image format pictures are decoded into
+	char fourcc[ 5 ];
+	snprintf( fourcc, sizeof( fourcc ), "%c%c%c%c", info->codec & 0xff, ( info->codec >> 8 ) & 0xff,
+			  ( info->codec >> 16 ) & 0xff, ( info->codec >> 24 ) & 0xff );
+	mlt_properties_set( p, "_video_codec", info->codec ? fourcc : NULL );
+	mlt_properties_set_int( p, "_video_profile", info->profile );
+	// Decoding media to its end (e.g. for waveform) needs to know where that is
+	mlt_properties_set_int64( p, "_media_duration", info->duration );
+}
+
+// Called by VLC, when media parsed in background is done
+static void media_parsed_callback( const struct libvlc_event_t *event, void *data )
+{
+	producer_libvlc self = data;
+	mlt_properties p = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	if ( event->u.media_parsed_changed.new_status != libvlc_media_parsed_status_done )
+		return;
+
+	struct media_info_s info;
+	media_probe_read_tracks( self->media, &info );
+	media_probe_store( mlt_properties_get( p, "resource" ), &info );
+	set_stream_data( self, &info );
+
+	// Let whoever looks at metadata know it's there now
+	mlt_events_fire( p, "producer-changed", NULL );
+}
+
 static void collect_stream_data( producer_libvlc self )
 {
 	if ( self->media == NULL )
@@ -267,53 +571,36 @@ static void collect_stream_data( producer_libvlc self )
 		return;
 	}
 
-	int track_i;
-	unsigned int nb_tracks;
-	libvlc_media_track_t *track;
-	libvlc_video_track_t *v_track;
-
-	// Get handles to necessary objects
 	mlt_properties p = MLT_PRODUCER_PROPERTIES( self->parent );
-	libvlc_media_t *media = self->media;
-
-	// Collect media metadata
-	libvlc_media_parse( media );
-
-	// Read and save media metadata to properties
-	libvlc_media_track_t **tracks;
-	nb_tracks = libvlc_media_tracks_get( media, &tracks );
-
-	// Search for default video track to fetch metadata
-	for ( track_i = 0; track_i < nb_tracks; track_i++ ) {
-		track = tracks[ track_i ];
-
-		// We pick first video track as the default one
-		if ( track->i_type == libvlc_track_video ) {
-			v_track = track->video;
-			// This sets metadata, which can be useful for creating auto-profile
-			mlt_properties_set_int( p, "meta.media.width", v_track->i_width );
-			mlt_properties_set_int( p, "meta.media.height", v_track->i_height );
-			mlt_properties_set_int( p, "meta.media.frame_rate_num", v_track->i_frame_rate_num );
-			mlt_properties_set_int( p, "meta.media.frame_rate_den", v_track->i_frame_rate_den );
-			mlt_properties_set_int( p, "meta.media.sample_aspect_num", v_track->i_sar_num );
-			mlt_properties_set_int( p, "meta.media.sample_aspect_den", v_track->i_sar_den );
-			break;
-		}
+	struct media_info_s info;
+
+	// Media we've seen before (and which hasn't changed since) doesn't need parsing
+	if ( !media_probe_lookup( mlt_properties_get( p, "resource" ), &info ) )
+	{
+		set_stream_data( self, &info );
+		return;
 	}
-	libvlc_media_tracks_release( tracks, nb_tracks );
-}
 
-static int setup_smem( producer_libvlc self )
-{
-	mlt_profile profile = mlt_service_profile( MLT_PRODUCER_SERVICE( self->parent ) );
-	if ( profile == NULL )
+	// In non-blocking mode, metadata gets set once VLC parses media in background
+	if ( media_probe_async_enabled( ) )
 	{
-		mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_ERROR, "%s\n", "setup_smem: Could not fetch mlt_profile\n" );
-		return 1;
+		libvlc_event_attach( libvlc_media_event_manager( self->media ), libvlc_MediaParsedChanged,
+							 media_parsed_callback, self );
+		self->media_parse_pending = 1;
+		media_probe_start( self->media );
+		return;
 	}
 
-	char vcodec[] = "RV24";
-	char acodec[] = "s16l";
+	if ( !media_probe_parse( self->media, &info ) )
+	{
+		media_probe_store( mlt_properties_get( p, "resource" ), &info );
+		set_stream_data( self, &info );
+	}
+}
+
+static void setup_properties( producer_libvlc self )
+{
+	mlt_profile profile = mlt_service_profile( MLT_PRODUCER_SERVICE( self->parent ) );
 
 	mlt_properties p = MLT_PRODUCER_PROPERTIES( self->parent );
 
@@ -326,242 +613,1722 @@ static int setup_smem( producer_libvlc self )
 	mlt_properties_set_int( p, "_channels", mlt_properties_get_int( p, "channels" ) );
 	mlt_properties_set_int( p, "_frequency", mlt_properties_get_int( p, "frequency" ) );
 	mlt_properties_set_int( p, "_mlt_audio_format", mlt_audio_s16 );
-	mlt_properties_set_int( p, "_mlt_image_format", mlt_image_rgb24 );
+	// Image format gets chosen when decoder starts
+	mlt_properties_set_int( p, "_mlt_image_format", mlt_image_yuv420p );
+}
 
-	// Build smem options string
-	char smem_options[ 1000 ];
-	sprintf( smem_options,
-			 ":sout=#transcode{"
-			 "vcodec=%s,"
-			 "fps=%s,"
-			 "width=%d,"
-			 "height=%d,"
-			 "acodec=%s,"
-			 "channels=%d,"
-			 "samplerate=%d,"
-			 "}:smem{"
-			 "no-time-sync,"
-			 "audio-prerender-callback=%" PRIdPTR ","
-			 "audio-postrender-callback=%" PRIdPTR ","
-			 "video-prerender-callback=%" PRIdPTR ","
-			 "video-postrender-callback=%" PRIdPTR ","
-			 "audio-data=%" PRIdPTR ","
-			 "video-data=%" PRIdPTR ","
-			 "}",
-			 vcodec,
-			 mlt_properties_get( p, "_fps" ),
-			 mlt_properties_get_int( p, "_width" ),
-			 mlt_properties_get_int( p, "_height" ),
-			 acodec,
-			 mlt_properties_get_int( p, "_channels" ),
-			 mlt_properties_get_int( p, "_frequency" ),
-			 (intptr_t)(void*)&audio_prerender_callback,
-			 (intptr_t)(void*)&audio_postrender_callback,
-			 (intptr_t)(void*)&video_prerender_callback,
-			 (intptr_t)(void*)&video_postrender_callback,
-			 (intptr_t)(void*)self,
-			 (intptr_t)(void*)self );
-
-	// Supply smem options to libVLC
-	libvlc_media_add_option( self->media, smem_options );
+static mlt_image_format image_format_from_name( const char *name )
+{
+	if ( name == NULL )
+		return mlt_image_none;
+	else if ( !strcmp( name, "rgb24" ) )
+		return mlt_image_rgb24;
+	else if ( !strcmp( name, "rgb24a" ) )
+		return mlt_image_rgb24a;
+	else if ( !strcmp( name, "yuv422" ) )
+		return mlt_image_yuv422;
+	else if ( !strcmp( name, "yuv420p" ) )
+		return mlt_image_yuv420p;
+	else
+		return mlt_image_none;
+}
 
-	return 0;
+// Picks MLT image format closest to what decoder of video codec produces, so
+// VLC has as little conversion to do as possible. Raw codecs are chromas
+// themselves, compressed ones are 4:2:0, unless their profile says otherwise.
+static mlt_image_format image_format_from_codec( const char *codec, int profile )
+{
+	if ( codec == NULL )
+		return mlt_image_yuv420p;
+	// RGB without alpha
+	else if ( !strncmp( codec, "RV24", 4 ) || !strncmp( codec, "RV16", 4 ) ||
+			  !strncmp( codec, "RV15", 4 ) )
+		return mlt_image_rgb24;
+	// RGB with alpha
+	else if ( !strncmp( codec, "RGBA", 4 ) || !strncmp( codec, "BGRA", 4 ) ||
+			  !strncmp( codec, "RV32", 4 ) || !strncmp( codec, "ARGB", 4 ) )
+		return mlt_image_rgb24a;
+	// 4:2:2 and 4:4:4 (raw, ProRes, DNxHD, H.264 High 4:2:2 and 4:4:4)
+	// end up as packed 4:2:2
+	else if ( !strncmp( codec, "I422", 4 ) || !strncmp( codec, "J422", 4 ) ||
+			  !strncmp( codec, "I444", 4 ) || !strncmp( codec, "J444", 4 ) ||
+			  !strncmp( codec, "UYVY", 4 ) || !strncmp( codec, "YUY2", 4 ) ||
+			  !strncmp( codec, "YUYV", 4 ) || !strncmp( codec, "YVYU", 4 ) ||
+			  !strncmp( codec, "VYUY", 4 ) || !strncmp( codec, "v210", 4 ) ||
+			  !strncmp( codec, "I2", 2 ) || !strncmp( codec, "I4", 2 ) ||
+			  !strncmp( codec, "apc", 3 ) || !strncmp( codec, "ap4", 3 ) ||
+			  !strncmp( codec, "AVdn", 4 ) ||
+			  ( !strncmp( codec, "h264", 4 ) && ( profile == 122 || profile == 244 ) ) )
+		return mlt_image_yuv422;
+	// 4:2:0 family (raw I420, YV12, NV12..., and nearly every compressed codec)
+	else
+		return mlt_image_yuv420p;
 }
 
+// Makes VLC decode into our buffers through stream output, which doesn't pace
+// decoding to real time and gives us stream timestamps of pictures and audio.
+// Pictures get converted straight to frame rate, size and format of frames.
+// Direct video/audio callbacks (libvlc_video_set_callbacks and friends) would
+// spare the transcode pass, but with libVLC 3 they're paced by the playback
+// clock, give pictures no timestamps and mute audio past 4x rate, so they
+// can't decode faster than real time.
 // WARNING: Lock cache_mutex before calling this function
-static void smem_pack_frames_or_block( producer_libvlc self )
+static void setup_smem( producer_libvlc self )
 {
-	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+	mlt_properties p = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	// Requested format takes precedence (as it is now, it may have been set
+	// after producer got created), otherwise pictures stay in the family
+	// decoder produces them in, so transcode doesn't convert colors
+	mlt_properties_set( p, "_requested_image_format", mlt_properties_get( p, "mlt_image_format" ) );
+	mlt_image_format vfmt = image_format_from_name( mlt_properties_get( p, "_requested_image_format" ) );
+	if ( vfmt == mlt_image_none )
+		vfmt = image_format_from_codec( mlt_properties_get( p, "_video_codec" ), mlt_properties_get_int( p, "_video_profile" ) );
+	const char *vcodec = vfmt == mlt_image_rgb24 ? "RV24" :
+						 vfmt == mlt_image_rgb24a ? "RGBA" :
+						 vfmt == mlt_image_yuv422 ? "YUY2" : "I420";
+
+	// VLC scales to MLT profile size (or a fraction of it when decoding proxy),
+	// chroma subsampling needs even dimensions
+	int width = mlt_properties_get_int( p, "_width" ) / self->proxy_scale;
+	int height = mlt_properties_get_int( p, "_height" ) / self->proxy_scale;
+	if ( vfmt == mlt_image_yuv420p || vfmt == mlt_image_yuv422 )
+		width &= ~1;
+	if ( vfmt == mlt_image_yuv420p )
+		height &= ~1;
+
+	self->video_format = vfmt;
+	mlt_properties_set_int( p, "_mlt_image_format", vfmt );
+	mlt_properties_set_int( p, "_video_buffer_size", mlt_image_format_size( vfmt, width, height, NULL ) );
+
+	// Media keeps the latest option of each name
+	char smem_options[ 1000 ];
+	snprintf( smem_options, sizeof( smem_options ),
+			  ":sout=#transcode{"
+			  "vcodec=%s,"
+			  "fps=%s,"
+			  "width=%d,"
+			  "height=%d,"
+			  "acodec=s16l,"
+			  "channels=%d,"
+			  "samplerate=%d,"
+			  "}:smem{"
+			  "no-time-sync,"
+			  "audio-prerender-callback=%" PRIdPTR ","
+			  "audio-postrender-callback=%" PRIdPTR ","
+			  "video-prerender-callback=%" PRIdPTR ","
+			  "video-postrender-callback=%" PRIdPTR ","
+			  "audio-data=%" PRIdPTR ","
+			  "video-data=%" PRIdPTR ","
+			  "}",
+			  vcodec,
+			  mlt_properties_get( p, "_fps" ),
+			  width,
+			  height,
+			  mlt_properties_get_int( p, "_channels" ),
+			  mlt_properties_get_int( p, "_frequency" ),
+			  ( intptr_t )( void * )&audio_prerender_callback,
+			  ( intptr_t )( void * )&audio_postrender_callback,
+			  ( intptr_t )( void * )&video_prerender_callback,
+			  ( intptr_t )( void * )&video_postrender_callback,
+			  ( intptr_t )( void * )self,
+			  ( intptr_t )( void * )self );
 
-	int cache_size = mlt_properties_get_int( properties, "_frame_cache_size" );
+	libvlc_media_add_option( self->media, smem_options );
+}
 
-	mlt_position earliest_frame_pos = frame_cache_earliest_frame_position( self->cache );
-	mlt_position latest_frame_pos = frame_cache_latest_frame_position( self->cache );
+// Stream timestamps start wherever container says, so the first one decoded from
+// the beginning of media is media time zero. Audio, which arrived before we knew
+// it, gets translated too.
+// WARNING: Lock cache_mutex before calling this function
+static void decoder_set_pts_origin( producer_libvlc self, int64_t pts )
+{
+	self->pts_origin = pts;
+	buffer_queue_shift_audio( self->bqueue, -pts );
+	keyframe_index_insert( self->kf_index, 0 );
 
-	// Block if rendering packing new frame would erase the one we need from cache
-	while ( earliest_frame_pos == mlt_producer_position( self->parent ) && latest_frame_pos - earliest_frame_pos + 1 == cache_size && !self->during_seek )
+	// Decoder started at the beginning just to get here, now it heads for the request
+	if ( self->during_seek )
 	{
-		pthread_cond_wait( &self->cache_cond, &self->cache_mutex );
+		self->during_seek = 0;
+		decoder_seek( self, self->seek_request_position, self->decode_stop_position, self->reverse );
 	}
+}
+
+// Translates stream timestamp to media time (both in microseconds)
+// WARNING: Lock cache_mutex before calling this function
+static int64_t decoder_media_time( producer_libvlc self, int64_t pts )
+{
+	// Timestamp stays as it is until decoder_set_pts_origin() translates it
+	if ( self->pts_origin == -1 )
+		return pts;
+
+	return pts - self->pts_origin;
+}
+
+// Checks, if picture (or audio in audio only mode) with given media time and
+// duration completes the pending seek. VLC lands on the keyframe preceding seek
+// target and we decode forward from there, until we reach the target.
+// WARNING: Lock cache_mutex before calling this function
+static void decoder_seek_progress( producer_libvlc self, int64_t pts, int64_t duration )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+	int64_t target_pts = self->seek_request_pts;
 
-	if ( !self->during_seek )
+	if ( !self->seek_landed )
 	{
-		mlt_frame frame = buffer_queue_pack_frame( self->bqueue, self->smem_position );
-		if ( frame != NULL )
+		// Data decoded before the seek may still be in flight. VLC jumping
+		// to a keyframe shows up as a discontinuity in timestamps.
+		if ( self->latest_pts == -1 || pts < self->latest_pts || pts > self->latest_end_pts + duration / 2 )
+		{
+			mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "decoder_seek_progress: Landed on keyframe at %" PRId64 "\n", pts );
+			keyframe_index_insert( self->kf_index, pts );
+			mlt_properties_set_int( properties, "keyframe_count", keyframe_index_count( self->kf_index ) );
+			self->seek_landed = 1;
+		}
+		// Stale data running continuously into the target is just as good
+		else if ( self->latest_pts + duration / 2 < target_pts && pts + duration / 2 >= target_pts )
 		{
-			self->smem_position++;
-			frame_cache_put_frame( self->cache, frame );
+			self->seek_landed = 1;
 		}
 	}
+
+	if ( !self->seek_landed )
+		return;
+
+	if ( pts + duration / 2 < target_pts )
+	{
+		self->seek_decoded_frames++;
+		return;
+	}
+
+	if ( pts - target_pts > duration / 2 )
+		mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "decoder_seek_progress: Landed %" PRId64 "us after requested timestamp\n", pts - target_pts );
+
+	self->audio_trim_pending = buffer_queue_trim_audio( self->bqueue, target_pts );
+	self->during_seek = 0;
+	self->decoder_position = self->seek_request_position;
+
+	// Whatever the seek took apart from decoding forward is its own latency
+	double latency = wall_clock_time( ) - self->seek_start_time - self->seek_decoded_frames * self->frame_decode_time;
+	if ( latency < 0 )
+		latency = 0;
+	self->seek_latency += SEEK_LATENCY_WEIGHT * ( latency - self->seek_latency );
+	mlt_properties_set_double( properties, "seek_latency", self->seek_latency / 1000.0 );
 }
 
-static void audio_prerender_callback( void* p_audio_data, uint8_t** pp_pcm_buffer, size_t size )
+// Starts seeking VLC to position, without waiting for it to land. Decoder stops
+// after stop_position (-1 for no limit). Audio of reverse chunks is ignored.
+// WARNING: Lock cache_mutex before calling this function
+static void decoder_seek( producer_libvlc self, mlt_position position, mlt_position stop_position, int reverse )
 {
-	producer_libvlc self = p_audio_data;
-
-	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "audio_prerender_callback: start\n" );
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+	double fps = mlt_properties_get_double( properties, "_fps" );
 
-	// If we're terminating, we need to abort render
-	if ( self->terminating )
-		*pp_pcm_buffer = NULL;
-	else
-		*pp_pcm_buffer = mlt_pool_alloc( size * sizeof( uint8_t ) );
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "decoder_seek: Seeking to pos %d\n", position );
+	mlt_properties_set_int( properties, "seek_count", mlt_properties_get_int( properties, "seek_count" ) + 1 );
 
-	return;
+	// VLC merges seeks it hasn't started yet, so the one in flight is just dropped
+	if ( self->during_seek )
+		mlt_properties_set_int( properties, "superseded_seek_count",
+			mlt_properties_get_int( properties, "superseded_seek_count" ) + 1 );
+
+	self->during_seek = 1;
+	self->seek_landed = 0;
+	self->seek_decoded_frames = 0;
+	self->seek_clock = libvlc_clock( );
+	self->seek_start_time = wall_clock_time( );
+	// Decode time measurement would include seek latency
+	self->decode_time_valid = 0;
+	self->seek_request_position = position;
+	self->seek_request_timestamp = 1000.0 * position / fps + 0.5;
+	self->seek_request_pts = 1000000.0 * position / fps + 0.5;
+	self->decode_stop_position = stop_position;
+
+	self->reverse = reverse;
+
+	// Frames queued so far are of no use after the seek, cached ones
+	// stay around in case we come back to them
+	buffer_queue_purge( self->bqueue );
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "decoder_seek: Requested timestamp is %" PRId64 "\n", self->seek_request_timestamp );
+	libvlc_media_player_set_time( self->media_player, self->seek_request_timestamp );
+	decoder_throttle( self, 0 );
 }
 
-static void audio_postrender_callback( void* p_audio_data, uint8_t* p_pcm_buffer, unsigned int channels,
-									   unsigned int rate, unsigned int nb_samples, unsigned int bits_per_sample,
-									   size_t size, int64_t pts )
+// Makes decoder head for position, which isn't in cache. Seeks only if decoder
+// isn't going to get there anyway.
+// WARNING: Lock cache_mutex before calling this function
+static void decoder_request( producer_libvlc self, mlt_position position, int reverse )
 {
-	producer_libvlc self = p_audio_data;
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
 
-	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "audio_postrender_callback: start\n" );
+	int read_ahead = producer_read_ahead( self );
+	int chunk_size = mlt_properties_get_int( properties, "reverse_chunk_size" );
+	if ( chunk_size < 1 )
+		chunk_size = 1;
 
-	buffer_queue_insert_audio_buffer( self->bqueue, p_pcm_buffer, size );
+	// Decoding continues from decoder_position
+	mlt_position decoded_position = self->decoder_position - 1;
 
-	pthread_mutex_lock( &self->cache_mutex );
-	// Check if we have seeked already
-	if ( self->during_seek )
+	// Requests past prefetched range (e.g. playing on after preroll) lift its limit
+	if ( !reverse && !self->reverse && self->decode_stop_position != -1 && position > self->decode_stop_position )
+		self->decode_stop_position = -1;
+
+	if ( reverse )
 	{
-		int64_t vlc_timestamp = libvlc_media_player_get_time( self->media_player );
-		mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "audio_postrender_callback: now seeking. Current timestamp %" PRId64 "\n", vlc_timestamp );
-		if ( vlc_timestamp == self->seek_request_timestamp )
+		// Unless the chunk VLC is decoding has it, we need a new one ending here
+		if ( !self->reverse || position < self->seek_request_position || position > self->decode_stop_position ||
+			 ( !self->during_seek && position < self->decoder_position ) )
 		{
-			buffer_queue_purge( self->bqueue );
-			frame_cache_purge( self->cache );
-			self->during_seek = 0;
-			self->smem_position = self->seek_request_position;
+			mlt_position chunk_start = position - chunk_size + 1;
+			decoder_seek( self, chunk_start > 0 ? chunk_start : 0, position, 1 );
 		}
 	}
+	else if ( self->reverse || position <= decoded_position )
+	{
+		// Going backwards (or leaving reverse playback) always requires seek
+		decoder_seek( self, position, -1, 0 );
+	}
+	else if ( position >= self->decoder_position + read_ahead )
+	{
+		// Requests within read ahead of decoder just wait for it, others
+		// can be running ahead of us. Going further requires seek only if it's faster than decoding
+		if ( seek_is_cheaper( self, position, decoded_position ) )
+			decoder_seek( self, position, -1, 0 );
+		else
+			mlt_properties_set_int( properties, "decode_forward_count",
+				mlt_properties_get_int( properties, "decode_forward_count" ) + 1 );
+	}
+}
 
-	// If we're not seeking, we try to pack buffer into frame
-	if ( !self->during_seek )
-		smem_pack_frames_or_block( self );
-
-	// Broadcast to MLT, because frame_cache may now have the frame it's requesting for
-	pthread_cond_broadcast( &self->cache_cond );
+static int64_t wall_clock_time( void )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return ( int64_t )now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-	pthread_mutex_unlock( &self->cache_mutex );
+// Frames decoded ahead of the position MLT requests next, read on every use
+// so changes apply to a running decoder
+static int producer_read_ahead( producer_libvlc self )
+{
+	int read_ahead = mlt_properties_get_int( MLT_PRODUCER_PROPERTIES( self->parent ), "read_ahead" );
+	return read_ahead < 1 ? 1 : read_ahead;
 }
 
-static void video_prerender_callback( void *data, uint8_t **p_buffer, size_t size )
+// Estimates, whether seeking to position would be faster than decoding forward
+// from the latest decoded position
+// WARNING: Lock cache_mutex before calling this function
+static int seek_is_cheaper( producer_libvlc self, mlt_position position, mlt_position decoded_position )
 {
-	producer_libvlc self = data;
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
 
-	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "video_prerender_callback: start\n" );
+	double fps = mlt_properties_get_double( properties, "_fps" );
+	int64_t target_pts = 1000000.0 * position / fps + 0.5;
 
-	// If we're terminating, we need to abort render
-	if ( self->terminating )
-		*p_buffer = NULL;
-	else
-		*p_buffer = mlt_pool_alloc( size * sizeof( uint8_t ) );
+	// After seek, VLC lands on a keyframe at most one keyframe interval
+	// before the target, and we decode forward from there
+	double keyframe_interval = keyframe_index_min_interval( self->kf_index );
+	if ( keyframe_interval == KEYFRAME_INDEX_INVALID_TIMESTAMP )
+		keyframe_interval = 1000000.0;
+	double forward_time = keyframe_interval / 2;
+	int64_t keyframe = keyframe_index_preceding( self->kf_index, target_pts );
+	if ( keyframe != KEYFRAME_INDEX_INVALID_TIMESTAMP && target_pts - keyframe < forward_time )
+		forward_time = target_pts - keyframe;
+
+	double seek_cost = self->seek_latency + forward_time * fps / 1000000.0 * self->frame_decode_time;
+	double decode_cost = ( position - decoded_position ) * self->frame_decode_time;
 
-	return;
+	mlt_properties_set_double( properties, "frame_decode_time", self->frame_decode_time / 1000.0 );
+	mlt_properties_set_double( properties, "seek_latency", self->seek_latency / 1000.0 );
+
+	return seek_cost < decode_cost;
 }
 
-static void video_postrender_callback( void *data, uint8_t *buffer, int width, int height,
-									   int bpp, size_t size, int64_t pts )
+// Parallel MLT consumers may have several requests in flight around the playhead.
+// Returns the earliest of them (including position, which is being requested).
+// WARNING: Lock cache_mutex before calling this function
+static mlt_position requests_window_start( producer_libvlc self, mlt_position position )
 {
-	producer_libvlc self = data;
-
-	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "video_postrender_callback: start\n" );
+	mlt_position start = position;
+	frame_waiter waiter;
+	for ( waiter = self->waiters; waiter != NULL; waiter = waiter->next )
+		if ( waiter->position < start )
+			start = waiter->position;
+	return start;
+}
 
-	buffer_queue_insert_video_buffer( self->bqueue, buffer, size );
+// Decoder keeps going until it gets past all requests in flight and
+// read ahead of the position MLT requests next.
+// WARNING: Lock cache_mutex before calling this function
+static mlt_position requests_window_end( producer_libvlc self )
+{
+	mlt_position end = self->next_request_position + producer_read_ahead( self );
+	if ( end > self->decode_out_position + 1 )
+		end = self->decode_out_position + 1;
+	// Prefetched range goes all the way to where decoder stops
+	if ( !self->reverse && self->decode_stop_position >= end )
+		end = self->decode_stop_position + 1;
+	frame_waiter waiter;
+	for ( waiter = self->waiters; waiter != NULL; waiter = waiter->next )
+		if ( waiter->position >= end )
+			end = waiter->position + 1;
+	return end;
+}
 
+// Makes decoder go through start..end ahead of any request for it and stop
+// after it, so that range ends up in cache. Starts decoder if needed.
+static void decoder_prefetch( producer_libvlc self, mlt_position start, mlt_position end )
+{
 	pthread_mutex_lock( &self->cache_mutex );
-	// Check if we have seeked already
-	if ( self->during_seek )
+	self->latest_request_time = wall_clock_time( );
+	if ( self->started || !decoder_start( self, start ) )
 	{
-		int64_t vlc_timestamp = libvlc_media_player_get_time( self->media_player );
-		mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "video_postrender_callback: now seeking. Current timestamp %" PRId64 "\n", vlc_timestamp );
-		if ( vlc_timestamp == self->seek_request_timestamp )
-		{
-			buffer_queue_purge( self->bqueue );
-			frame_cache_purge( self->cache );
-			self->during_seek = 0;
-			self->smem_position = self->seek_request_position;
-		}
+		frame_cache_protect( self->cache, start, end );
+		self->next_request_position = start;
+		// Decoder just started may be heading there already
+		if ( self->during_seek ? self->seek_request_position == start :
+			 !self->reverse && self->decoder_position == start )
+			self->decode_stop_position = end;
+		else
+			decoder_seek( self, start, end, 0 );
 	}
+	pthread_mutex_unlock( &self->cache_mutex );
 
-	// If we're not seeking, we try to pack buffer into frame
-	if ( !self->during_seek )
-		smem_pack_frames_or_block( self );
+	packer_wake( self );
+}
 
-	// Broadcast to MLT, because frame_cache may now have the frame it's requesting for
-	pthread_cond_broadcast( &self->cache_cond );
+// Starts decoding count frames from in point, so the first request doesn't
+// wait for VLC to open media. Fires producer-ready once they're in cache.
+static void producer_preroll( producer_libvlc self, int count )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+	mlt_position start = mlt_producer_get_in( self->parent );
+	mlt_position end = start + count - 1;
 
+	pthread_mutex_lock( &self->cache_mutex );
+	int ready = frame_cache_contains( self->cache, end );
+	self->preroll_position = ready ? -1 : end;
+	self->prerolled = 1;
 	pthread_mutex_unlock( &self->cache_mutex );
+
+	if ( ready )
+		mlt_events_fire( properties, "producer-ready", NULL );
+	else
+		decoder_prefetch( self, start, end );
 }
 
-static int producer_get_frame( mlt_producer producer, mlt_frame_ptr frame_ptr, int index )
+// Preroll is set by application, once in and out points are. Setting
+// waveform_file (re)starts generation of its peak file, setting probe_files
+// (re)starts probing them.
+static void producer_property_changed( mlt_service owner, producer_libvlc self, char *name )
 {
-	// Get handle to libVLC's producer
-	producer_libvlc self = producer->child;
+	if ( name != NULL && !strcmp( name, "waveform_file" ) )
+		waveform_start( self );
+	if ( name != NULL && !strcmp( name, "probe_files" ) )
+		probe_start( self );
+	// Packer picks up new timeout with its next wait
+	if ( name != NULL && !strcmp( name, "idle_timeout" ) )
+		packer_wake( self );
+
+	if ( name == NULL || strcmp( name, "preroll" ) )
+		return;
 
-	pthread_mutex_lock( &self->cache_mutex );
+	// Batch mode decodes on lanes, which start with the first request
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+	int preroll = mlt_properties_get_int( properties, "preroll" );
+	if ( preroll > 0 && !self->thumbnails && mlt_properties_get_int( properties, "batch_lanes" ) <= 1 )
+		producer_preroll( self, preroll );
+}
+
+// Packs buffered audio and video into frames, as long as they're within window
+// of requests and frame cache can take them. Returns 1 if it stopped because of either.
+// WARNING: Lock cache_mutex before calling this function
+static int decoder_pack_frames( producer_libvlc self )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	size_t frame_size = mlt_properties_get_int( properties, "_video_buffer_size" );
+	mlt_position window_end = requests_window_end( self );
+
+	while ( !self->during_seek )
+	{
+		if ( self->decoder_position >= window_end )
+			return 1;
+
+		// Next frame would push out one MLT is waiting for. Preroll
+		// longer than cache holds is as good as it gets.
+		if ( frame_cache_full( self->cache, frame_size ) )
+		{
+			if ( self->preroll_position != -1 )
+			{
+				self->preroll_position = -1;
+				self->ready_pending = 1;
+			}
+			return 1;
+		}
+
+		// Whole reverse chunk (or prefetched range) is in cache
+		if ( self->decode_stop_position != -1 && self->decoder_position > self->decode_stop_position )
+			return 1;
 
-	// Aquire current position
-	mlt_position current_position = mlt_producer_position( producer );
-	double fps = mlt_properties_get_double( MLT_PRODUCER_PROPERTIES( producer ), "_fps" );
-
-	mlt_position earliest_frame_pos =
-		frame_cache_earliest_frame_position( self->cache );
-	mlt_position latest_frame_pos =
-		frame_cache_latest_frame_position( self->cache );
-
-	// Seek and wait for seek if needed
-	if ( earliest_frame_pos > current_position || current_position - latest_frame_pos > SEEK_THRESHOLD )
-	{
-		mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "producer_get_frame: Seeking to pos %d\n", current_position );
-		self->during_seek = 1;
-		self->seek_request_position = current_position;
-		self->seek_request_timestamp = 1000.0 * current_position / fps + 0.5;
-		mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "producer_get_frame: Requested timestamp is %" PRId64 "\n", self->seek_request_timestamp );
-		libvlc_media_player_set_time( self->media_player, self->seek_request_timestamp );
-		while ( self->during_seek )
+		// Reverse chunks (and frames in video only mode) are packed without audio,
+		// MLT fills in silence
+		mlt_frame frame = buffer_queue_pack_frame( self->bqueue, self->decoder_position,
+			!self->reverse && !self->video_only, !self->audio_only );
+		if ( frame == NULL )
+			break;
+		// Frame width and height are those of the picture, consumers scale it as needed
+		if ( self->proxy_scale > 1 )
+			mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "proxy_scale", self->proxy_scale );
+
+		mlt_position position = self->decoder_position++;
+		size_t size = buffer_queue_frame_size( frame );
+		// Other producers of the same media get its decoded data too (if there
+		// are any). Reverse chunks carry no audio, so producers playing forward
+		// couldn't use them.
+		if ( !self->reverse )
+			shared_cache_put_frame( mlt_properties_get( properties, "_shared_cache_key" ), position, frame );
+		// Decoder may be passing through a region cached before
+		if ( frame_cache_put_frame( self->cache, frame, size ) )
+			mlt_frame_close( frame );
+
+		if ( position == self->preroll_position )
 		{
-			pthread_cond_broadcast( &self->cache_cond );
-			pthread_cond_wait( &self->cache_cond, &self->cache_mutex );
+			self->preroll_position = -1;
+			self->ready_pending = 1;
 		}
+
+		// Wake whoever waits for this frame
+		frame_waiter waiter;
+		for ( waiter = self->waiters; waiter != NULL; waiter = waiter->next )
+			if ( waiter->position == position )
+				pthread_cond_signal( &waiter->cond );
 	}
 
-	mlt_frame frame = NULL;
-	while ( !( frame = frame_cache_get_frame( self->cache, current_position ) ) )
+	return 0;
+}
+
+// We never block VLC threads when frame cache is full, they'd spin in
+// packer_push() meanwhile. VLC gets paused instead.
+// WARNING: Lock cache_mutex before calling this function
+static void decoder_throttle( producer_libvlc self, int cache_full )
+{
+	if ( cache_full && !self->paused && !self->terminating )
+	{
+		libvlc_media_player_set_pause( self->media_player, 1 );
+		self->paused = 1;
+		// Decode time measurement would include pause
+		self->decode_time_valid = 0;
+	}
+	else if ( !cache_full && self->paused )
 	{
-		pthread_cond_wait( &self->cache_cond, &self->cache_mutex );
+		libvlc_media_player_set_pause( self->media_player, 0 );
+		self->paused = 0;
 	}
+}
 
-	*frame_ptr = frame;
+static void audio_prerender_callback( void *data, uint8_t **buffer, size_t size )
+{
+	producer_libvlc self = data;
 
-	// Prepare next frame
-	mlt_producer_prepare_next( producer );
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "audio_prerender_callback: start\n" );
 
-	pthread_cond_broadcast( &self->cache_cond );
-	pthread_mutex_unlock( &self->cache_mutex );
-	return 0;
+	// VLC writes samples straight into storage of the queue slot they'll be
+	// pushed into (or drops them, if we don't give it any)
+	*buffer = spsc_queue_reserve( self->audio_queue, size );
 }
 
-static void producer_close( mlt_producer parent )
+static void audio_postrender_callback( void *data, uint8_t *buffer, unsigned int channels, unsigned int rate,
+									   unsigned int nb_samples, unsigned int bits_per_sample, size_t size, int64_t pts )
 {
-	if ( parent != NULL ) {
-		producer_libvlc self = parent->child;
+	producer_libvlc self = data;
 
-		// Stop smem threads
-		pthread_mutex_lock( &self->cache_mutex );
-		self->terminating = 1;
-		pthread_cond_broadcast( &self->cache_cond );
-		pthread_mutex_unlock( &self->cache_mutex );
-		libvlc_media_player_stop( self->media_player );
+	vlc_instance_log_thread( MLT_PRODUCER_SERVICE( self->parent ) );
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "audio_postrender_callback: start\n" );
 
-		// Release libVLC objects
-		libvlc_media_player_release( self->media_player );
-		libvlc_media_release( self->media );
-		libvlc_release( self->vlc );
+	struct decoded_item_s item;
+	memset( &item, 0, sizeof( item ) );
+	item.type = DECODED_AUDIO;
+	item.clock = libvlc_clock( );
+	item.pts = pts;
+	item.duration = rate > 0 ? ( int64_t )nb_samples * 1000000 / rate : 0;
+	item.buffer = buffer;
+	item.size = size;
+
+	packer_push( self, self->audio_queue, &item );
+}
+
+static void video_prerender_callback( void *data, uint8_t **buffer, size_t size )
+{
+	producer_libvlc self = data;
+
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "video_prerender_callback: start\n" );
+
+	// All pictures are the same size, pool recycles buffers of it
+	if ( size != self->video_buffer_size )
+	{
+		slab_pool_set_slab_size( self->video_pool, size );
+		self->video_buffer_size = size;
+	}
+
+	// VLC copies the picture straight into our buffer
+	*buffer = slab_pool_alloc( self->video_pool );
+	if ( *buffer != NULL )
+		return;
+
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_WARNING, "%s\n", "video_prerender_callback: out of memory, dropping picture" );
+	if ( size > self->fallback_size )
+	{
+		uint8_t *fallback_buffer = realloc( self->fallback_buffer, size );
+		if ( fallback_buffer == NULL )
+			return;
+		self->fallback_buffer = fallback_buffer;
+		self->fallback_size = size;
+	}
+	*buffer = self->fallback_buffer;
+}
+
+static void video_postrender_callback( void *data, uint8_t *buffer, int width, int height,
+									   int bpp, size_t size, int64_t pts )
+{
+	producer_libvlc self = data;
+
+	vlc_instance_log_thread( MLT_PRODUCER_SERVICE( self->parent ) );
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "video_postrender_callback: start\n" );
+
+	struct decoded_item_s item;
+	memset( &item, 0, sizeof( item ) );
+	item.type = DECODED_VIDEO;
+	item.clock = libvlc_clock( );
+	item.pts = pts;
+	// Picture we had no buffer for is lost (the previous one gets duplicated
+	// in its place), but its timestamp still tells us where decoder is
+	item.buffer = buffer != self->fallback_buffer ? buffer : NULL;
+	item.size = size;
+	item.vfmt = self->video_format;
+	item.width = width;
+	item.height = height;
+
+	// VLC isn't paced, so time since we returned to it is what it took to
+	// decode (and scale) this picture. Time spent waiting in packer_push()
+	// doesn't count.
+	int64_t callback_time = wall_clock_time( );
+	if ( self->latest_video_return != 0 )
+		item.decode_time = callback_time - self->latest_video_return;
+
+	packer_push( self, self->video_queue, &item );
+
+	self->latest_video_return = wall_clock_time( );
+}
+
+// Hands item over to packer thread. Queue gets full only if packer thread
+// falls behind, so we wait for it, unless producer is closing.
+static void packer_push( producer_libvlc self, spsc_queue queue, decoded_item item )
+{
+	while ( spsc_queue_push( queue, item ) )
+	{
+		if ( __atomic_load_n( &self->terminating, __ATOMIC_ACQUIRE ) || __atomic_load_n( &self->stopping, __ATOMIC_ACQUIRE ) )
+		{
+			packer_release( item );
+			return;
+		}
+		packer_wake( self );
+		usleep( 1000 );
+	}
+	packer_wake( self );
+}
+
+// Audio lives in storage of its queue slot, so only pictures need releasing
+static void packer_release( decoded_item item )
+{
+	if ( item->type == DECODED_VIDEO )
+		slab_pool_release( item->buffer );
+}
+
+static void packer_wake( producer_libvlc self )
+{
+	pthread_mutex_lock( &self->packer_mutex );
+	self->packer_pending = 1;
+	pthread_cond_signal( &self->packer_cond );
+	pthread_mutex_unlock( &self->packer_mutex );
+}
+
+// Runs in VLC event thread, which never takes cache_mutex. Decoding error
+// ends the stream just like the end of media does.
+static void media_player_end_callback( const struct libvlc_event_t *event, void *data )
+{
+	producer_libvlc self = data;
+
+	__atomic_store_n( &self->end_reached, 1, __ATOMIC_RELEASE );
+	packer_wake( self );
+}
+
+// WARNING: Lock cache_mutex before calling this function
+static void packer_handle_audio( producer_libvlc self, decoded_item item )
+{
+	// Without video, audio tells us where decoder is
+	if ( self->audio_only && self->pts_origin == -1 && item->clock >= self->seek_clock )
+		decoder_set_pts_origin( self, item->pts );
+
+	// Anything VLC handed over before the latest seek is stale
+	if ( item->clock < self->seek_clock )
+		return;
+	int64_t pts = decoder_media_time( self, item->pts );
+
+	// Audio is kept during seek, the part preceding seek target gets trimmed
+	// once decoder reaches it. Audio of reverse chunks isn't used at all.
+	if ( !self->reverse && !self->terminating )
+		buffer_queue_insert_audio_buffer( self->bqueue, item->buffer, item->size, pts );
+
+	if ( self->audio_only )
+	{
+		if ( self->during_seek )
+			decoder_seek_progress( self, pts, item->duration );
+		self->latest_pts = pts;
+		self->latest_end_pts = pts + item->duration;
+	}
+
+	if ( !self->during_seek && self->audio_trim_pending && !self->reverse )
+		self->audio_trim_pending = buffer_queue_trim_audio( self->bqueue, self->seek_request_pts );
+}
+
+// WARNING: Lock cache_mutex before calling this function
+static void packer_handle_video( producer_libvlc self, decoded_item item )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	double fps = mlt_properties_get_double( properties, "_fps" );
+	int64_t frame_duration = 1000000.0 / fps + 0.5;
+
+	// Decoding is unpaced, forward and reverse alike, so every picture counts
+	if ( self->decode_time_valid && item->decode_time != 0 )
+		self->frame_decode_time += DECODE_TIME_WEIGHT * ( item->decode_time - self->frame_decode_time );
+	self->decode_time_valid = 1;
+
+	if ( self->pts_origin == -1 && item->clock >= self->seek_clock )
+		decoder_set_pts_origin( self, item->pts );
+
+	// Anything VLC handed over before the latest seek is stale
+	if ( item->clock < self->seek_clock )
+	{
+		slab_pool_release( item->buffer );
+		return;
+	}
+	int64_t pts = decoder_media_time( self, item->pts );
+
+	if ( self->during_seek )
+	{
+		mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "packer_handle_video: now seeking. Current timestamp %" PRId64 "\n", pts );
+		decoder_seek_progress( self, pts, frame_duration );
+	}
+
+	// Pictures preceding seek target are only decoded to get to the target
+	if ( self->during_seek || self->terminating || item->buffer == NULL )
+	{
+		slab_pool_release( item->buffer );
+	}
+	else
+	{
+		buffer_queue_set_image_format( self->bqueue, item->vfmt, item->width, item->height );
+		buffer_queue_insert_video_buffer( self->bqueue, item->buffer, item->size, pts, slab_pool_release );
+	}
+
+	self->latest_pts = pts;
+	self->latest_end_pts = pts + frame_duration;
+}
+
+// Handles everything VLC threads have queued, in the order it happened
+// WARNING: Lock cache_mutex before calling this function
+static void packer_drain( producer_libvlc self )
+{
+	struct decoded_item_s audio, video;
+	int have_audio = !spsc_queue_peek( self->audio_queue, &audio );
+	int have_video = !spsc_queue_peek( self->video_queue, &video );
+
+	while ( have_audio || have_video )
+	{
+		if ( have_audio && ( !have_video || audio.clock <= video.clock ) )
+		{
+			// Samples stay in the queue slot until it's popped
+			packer_handle_audio( self, &audio );
+			spsc_queue_pop( self->audio_queue, &audio );
+			have_audio = !spsc_queue_peek( self->audio_queue, &audio );
+		}
+		else
+		{
+			spsc_queue_pop( self->video_queue, &video );
+			packer_handle_video( self, &video );
+			have_video = !spsc_queue_peek( self->video_queue, &video );
+		}
+	}
+}
+
+// Media player got to the end of media and everything it decoded is packed,
+// requests for frames it didn't deliver fail from now on
+// WARNING: Lock cache_mutex before calling this function
+static void decoder_end( producer_libvlc self )
+{
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "decoder_end: end of media at %d\n", self->decoder_position );
+
+	self->ended = 1;
+	// Seek past the end tells only that media ends before its target
+	mlt_position end = self->during_seek ? self->seek_request_position : self->decoder_position;
+	if ( self->end_position == -1 || end < self->end_position )
+		self->end_position = end;
+	if ( self->preroll_position != -1 )
+	{
+		self->preroll_position = -1;
+		self->ready_pending = 1;
+	}
+
+	frame_waiter waiter;
+	for ( waiter = self->waiters; waiter != NULL; waiter = waiter->next )
+		pthread_cond_signal( &waiter->cond );
+}
+
+static void *packer_thread( void *data )
+{
+	producer_libvlc self = data;
+
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	pthread_mutex_lock( &self->packer_mutex );
+	while ( !self->terminating )
+	{
+		// Without requests for this long, producer hibernates (0 for never)
+		int64_t idle_timeout = mlt_properties_get_int( properties, "idle_timeout" ) * 1000000LL;
+		int timed_out = 0;
+		while ( !self->packer_pending && !self->terminating && !timed_out )
+		{
+			if ( idle_timeout > 0 )
+			{
+				struct timespec deadline;
+				clock_gettime( CLOCK_REALTIME, &deadline );
+				deadline.tv_sec += idle_timeout / 1000000;
+				timed_out = pthread_cond_timedwait( &self->packer_cond, &self->packer_mutex, &deadline ) == ETIMEDOUT;
+			}
+			else
+			{
+				pthread_cond_wait( &self->packer_cond, &self->packer_mutex );
+			}
+		}
+		self->packer_pending = 0;
+		pthread_mutex_unlock( &self->packer_mutex );
+
+		pthread_mutex_lock( &self->cache_mutex );
+		// Decoder got restarted without us (e.g. at another proxy scale)
+		if ( !self->started || !pthread_equal( pthread_self( ), self->packer_thread ) )
+		{
+			pthread_mutex_unlock( &self->cache_mutex );
+			return NULL;
+		}
+		if ( timed_out && !self->terminating && self->waiters == NULL && !self->prerolled &&
+			 wall_clock_time( ) - self->latest_request_time >= idle_timeout )
+		{
+			// Packer thread ends here, next request starts a new one
+			libvlc_media_player_t *media_player = decoder_hibernate( self );
+			pthread_mutex_unlock( &self->cache_mutex );
+			decoder_release( self, media_player );
+			return NULL;
+		}
+		// Whatever VLC decoded before reaching the end is queued by now
+		int end_reached = __atomic_load_n( &self->end_reached, __ATOMIC_ACQUIRE );
+		packer_drain( self );
+		// If we're not seeking, we try to pack buffers into frames
+		int stalled = decoder_pack_frames( self );
+		decoder_throttle( self, stalled );
+		if ( end_reached && !stalled && !self->ended )
+			decoder_end( self );
+		int ready = self->ready_pending;
+		self->ready_pending = 0;
+		pthread_mutex_unlock( &self->cache_mutex );
+
+		// Listeners may ask for frames right away, so no lock is held
+		if ( ready )
+			mlt_events_fire( properties, "producer-ready", NULL );
+
+		pthread_mutex_lock( &self->packer_mutex );
+	}
+	pthread_mutex_unlock( &self->packer_mutex );
+
+	return NULL;
+}
+
+// Valid proxy scale requested by user, 1 means full resolution
+static int proxy_scale_from_properties( mlt_properties properties );
+
+// Frames of producers with equal keys are interchangeable, they're of the same
+// media decoded the same way. Decoding mode is taken as latched by decoder_start.
+// WARNING: Lock cache_mutex before calling this function
+static const char *shared_cache_key( producer_libvlc self )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	// Key of running decoder doesn't change
+	if ( self->started && mlt_properties_get( properties, "_shared_cache_key" ) != NULL )
+		return mlt_properties_get( properties, "_shared_cache_key" );
+
+	int audio_only = mlt_properties_get_int( properties, "audio_only" );
+	int video_only = !audio_only && mlt_properties_get_int( properties, "video_only" );
+	if ( mlt_properties_get( properties, "_audio_only" ) != NULL )
+	{
+		audio_only = mlt_properties_get_int( properties, "_audio_only" );
+		video_only = mlt_properties_get_int( properties, "_video_only" );
+	}
+	const char *resource = mlt_properties_get( properties, "resource" );
+	const char *image_format = mlt_properties_get( properties, "mlt_image_format" );
+
+	size_t size = strlen( resource ) + 256;
+	char *key = malloc( size );
+	if ( key == NULL )
+		return NULL;
+	snprintf( key, size, "%s|%s|%dx%d|%d|%d|%d|%d|%d|%s", resource, image_format ? image_format : "",
+		mlt_properties_get_int( properties, "_width" ), mlt_properties_get_int( properties, "_height" ),
+		proxy_scale_from_properties( properties ), audio_only, video_only,
+		mlt_properties_get_int( properties, "_channels" ), mlt_properties_get_int( properties, "_frequency" ),
+		mlt_properties_get( properties, "_fps" ) );
+	mlt_properties_set( properties, "_shared_cache_key", key );
+	free( key );
+
+	return mlt_properties_get( properties, "_shared_cache_key" );
+}
+
+static int proxy_scale_from_properties( mlt_properties properties )
+{
+	int scale = mlt_properties_get_int( properties, "proxy_scale" );
+	return scale == 2 || scale == 4 || scale == 8 ? scale : 1;
+}
+
+// Creates media player and starts decoding at position. Producers start on
+// their first request (usually at in point), not when they're loaded, and
+// again after hibernation.
+// WARNING: Lock cache_mutex before calling this function
+static int decoder_start( producer_libvlc self, mlt_position position )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	// Hibernated media player may still be running our callbacks
+	while ( self->stopping )
+		pthread_cond_wait( &self->stopped_cond, &self->cache_mutex );
+
+	// Packer thread of hibernated player has ended already
+	if ( self->packer_started )
+	{
+		pthread_join( self->packer_thread, NULL );
+		self->packer_started = 0;
+	}
+
+	// Decoding mode is fixed once media has options for it
+	if ( mlt_properties_get( properties, "_audio_only" ) == NULL )
+	{
+		self->audio_only = mlt_properties_get_int( properties, "audio_only" );
+		self->video_only = !self->audio_only && mlt_properties_get_int( properties, "video_only" );
+		mlt_properties_set_int( properties, "_audio_only", self->audio_only );
+		mlt_properties_set_int( properties, "_video_only", self->video_only );
+		// Elementary stream we don't need isn't even selected by demuxer
+		if ( self->audio_only )
+			libvlc_media_add_option( self->media, ":no-video" );
+		else if ( self->video_only )
+			libvlc_media_add_option( self->media, ":no-audio" );
+	}
+
+	// Proxy scale is latched for the whole life of media player
+	self->proxy_scale = proxy_scale_from_properties( properties );
+	mlt_properties_set_int( properties, "_proxy_scale", self->proxy_scale );
+	// Decoders supporting it skip computing full resolution altogether
+	// (libavcodec lowres goes down to 1/4), VLC scales the rest of the way
+	int lowres = self->proxy_scale >= 4 ? 2 : self->proxy_scale == 2 ? 1 : 0;
+	if ( lowres != self->media_lowres )
+	{
+		char option[ 32 ];
+		snprintf( option, sizeof( option ), ":avcodec-lowres=%d", lowres );
+		libvlc_media_add_option( self->media, option );
+		self->media_lowres = lowres;
+	}
+
+	// VLC opens media right at requested time, instead of decoding from the
+	// beginning until we seek. Media keeps the latest option of each name.
+	// Until we know where stream timestamps start, decoder starts at the
+	// beginning and seeks once it has seen the first of them.
+	double fps = mlt_properties_get_double( properties, "_fps" );
+	int64_t start_pts = 1000000.0 * position / fps + 0.5;
+	int64_t open_pts = self->pts_origin != -1 ? start_pts : 0;
+	char start_option[ 64 ];
+	snprintf( start_option, sizeof( start_option ), ":start-time=%" PRId64 ".%06d",
+		open_pts / 1000000, ( int )( open_pts % 1000000 ) );
+	libvlc_media_add_option( self->media, start_option );
+
+	// Cache budgets are applied as they're set now
+	frame_cache_set_size( self->cache, mlt_properties_get_int64( properties, "frame_cache_size" ) );
+	// Budget shared by all libVLC producers in process
+	int64_t global_size = mlt_properties_get_int64( properties, "frame_cache_global_size" );
+	if ( global_size > 0 )
+		frame_cache_set_global_size( global_size );
+
+	// Frames this decoder packs are shared under key of its decoding mode
+	shared_cache_key( self );
+	if ( mlt_properties_get( properties, "frame_cache_shared_size" ) != NULL )
+		shared_cache_set_size( mlt_properties_get_int64( properties, "frame_cache_shared_size" ) );
+
+	// Slab size gets known once VLC asks for the first picture buffer
+	self->video_pool = slab_pool_init( 0, mlt_properties_get_int( properties, "video_pool_size" ) );
+	if ( self->video_pool == NULL ) goto cleanup;
+	self->video_buffer_size = 0;
+
+	// Make VLC decode into our buffers (at proxy scale of this player)
+	setup_smem( self );
+
+	self->media_player = libvlc_media_player_new_from_media( self->media );
+	if ( self->media_player == NULL ) goto cleanup;
+	vlc_instance_log_register( self->media_player, MLT_PRODUCER_SERVICE( self->parent ) );
+	libvlc_event_manager_t *events = libvlc_media_player_event_manager( self->media_player );
+	libvlc_event_attach( events, libvlc_MediaPlayerEndReached, media_player_end_callback, self );
+	libvlc_event_attach( events, libvlc_MediaPlayerEncounteredError, media_player_end_callback, self );
+	__atomic_store_n( &self->end_reached, 0, __ATOMIC_RELEASE );
+	self->ended = 0;
+
+	// Unless new media player starts at media time zero, it's as if seeking there
+	self->decoder_position = position;
+	self->during_seek = position > 0;
+	self->seek_landed = 0;
+	self->seek_decoded_frames = 0;
+	self->seek_clock = libvlc_clock( );
+	self->seek_start_time = wall_clock_time( );
+	self->seek_request_position = position;
+	self->seek_request_timestamp = start_pts / 1000;
+	self->seek_request_pts = start_pts;
+	self->decode_out_position = mlt_producer_get_out( self->parent ) + OUT_POINT_MARGIN;
+	self->audio_trim_pending = 0;
+	self->latest_pts = -1;
+	self->paused = 0;
+	self->reverse = 0;
+	self->decode_stop_position = -1;
+	self->decode_time_valid = 0;
+	self->latest_video_return = 0;
+
+	if ( pthread_create( &self->packer_thread, NULL, packer_thread, self ) != 0 ) goto cleanup;
+	self->packer_started = 1;
+
+	// Start decoding. Batch lanes decode segments of their own, nobody else takes them.
+	libvlc_media_player_play( self->media_player );
+	self->started = 1;
+	if ( !mlt_properties_get_int( properties, "_batch_lane" ) )
+	{
+		shared_cache_register( mlt_properties_get( properties, "_shared_cache_key" ) );
+		self->shared_cache_registered = 1;
+	}
+
+	return 0;
+
+cleanup:
+	if ( self->media_player )
+	{
+		vlc_instance_log_unregister( self->media_player );
+		libvlc_media_player_release( self->media_player );
+		self->media_player = NULL;
+	}
+	slab_pool_close( self->video_pool );
+	self->video_pool = NULL;
+	return 1;
+}
+
+// Detaches media player and drops everything decoded, so idle producers far from
+// the playhead don't hold memory and threads. Next request starts decoding again.
+// Stopping VLC waits for its threads, which may be waiting for packer thread,
+// so detached player is left to decoder_release() called without lock.
+// WARNING: Lock cache_mutex before calling this function
+static libvlc_media_player_t *decoder_hibernate( producer_libvlc self )
+{
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_DEBUG, "%s\n", "decoder_hibernate: idle, releasing media player" );
+
+	// VLC threads won't wait for packer thread anymore
+	__atomic_store_n( &self->stopping, 1, __ATOMIC_RELEASE );
+	libvlc_media_player_t *media_player = self->media_player;
+	self->media_player = NULL;
+
+	buffer_queue_purge( self->bqueue );
+	frame_cache_purge( self->cache );
+	if ( self->shared_cache_registered )
+		shared_cache_unregister( mlt_properties_get( MLT_PRODUCER_PROPERTIES( self->parent ), "_shared_cache_key" ) );
+	self->shared_cache_registered = 0;
+
+	self->reverse = 0;
+	self->started = 0;
+
+	return media_player;
+}
+
+// Stops and releases media player decoder_hibernate() detached, along with whatever
+// its threads queued. Caller must be the only one popping queues (packer thread,
+// or the thread which joined it).
+static void decoder_release( producer_libvlc self, libvlc_media_player_t *media_player )
+{
+	libvlc_media_player_stop( media_player );
+
+	struct decoded_item_s item;
+	while ( !spsc_queue_pop( self->audio_queue, &item ) )
+		packer_release( &item );
+	while ( !spsc_queue_pop( self->video_queue, &item ) )
+		packer_release( &item );
+
+	vlc_instance_log_unregister( media_player );
+	libvlc_media_player_release( media_player );
+
+	// Frames still referenced elsewhere keep video pool alive
+	slab_pool_close( self->video_pool );
+	self->video_pool = NULL;
+
+	pthread_mutex_lock( &self->cache_mutex );
+	__atomic_store_n( &self->stopping, 0, __ATOMIC_RELEASE );
+	pthread_cond_broadcast( &self->stopped_cond );
+	pthread_mutex_unlock( &self->cache_mutex );
+}
+
+// Cached frames stay in cache, every request gets a fresh frame sharing their picture,
+// so concurrent requests for the same position never share image stack or properties
+static mlt_frame producer_cached_frame( producer_libvlc self, mlt_position position )
+{
+	mlt_frame cached = frame_cache_get_frame( self->cache, position );
+	if ( cached == NULL )
+		return NULL;
+
+	mlt_frame frame = buffer_queue_frame_clone( cached, MLT_PRODUCER_SERVICE( self->parent ) );
+	if ( frame != NULL && mlt_properties_get( MLT_FRAME_PROPERTIES( cached ), "proxy_scale" ) != NULL )
+		mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "proxy_scale",
+			mlt_properties_get_int( MLT_FRAME_PROPERTIES( cached ), "proxy_scale" ) );
+	mlt_frame_close( cached );
+
+	return frame;
+}
+
+// Frame MLT gets when there's nothing to deliver (media ended before position,
+// decoder failed or producer is closing). Like blank frames of any MLT producer,
+// it makes consumers show test card and play silence, and playback goes on.
+static int producer_error_frame( producer_libvlc self, mlt_frame_ptr frame_ptr, mlt_position position )
+{
+	*frame_ptr = mlt_frame_init( MLT_PRODUCER_SERVICE( self->parent ) );
+	if ( *frame_ptr != NULL )
+	{
+		mlt_properties_set_int( MLT_FRAME_PROPERTIES( *frame_ptr ), "test_image", 1 );
+		mlt_properties_set_int( MLT_FRAME_PROPERTIES( *frame_ptr ), "test_audio", 1 );
+		// Media position of request, MLT gets one relative to in point
+		mlt_frame_set_position( *frame_ptr, position - mlt_producer_get_in( self->parent ) );
+	}
+	return *frame_ptr == NULL;
+}
+
+static int producer_get_frame( mlt_producer producer, mlt_frame_ptr frame_ptr, int index )
+{
+	// Get handle to libVLC's producer
+	producer_libvlc self = producer->child;
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( producer );
+
+	// Batch mode is chosen on first request, lanes decode instead of us
+	pthread_mutex_lock( &self->cache_mutex );
+	if ( self->lanes == NULL && !self->started && mlt_properties_get_int( properties, "batch_lanes" ) > 1 )
+		batch_start( self );
+	pthread_mutex_unlock( &self->cache_mutex );
+	if ( self->lanes != NULL )
+		return producer_get_batch_frame( producer, frame_ptr, index );
+
+	// Aquire current position (in media, not relative to in point)
+	mlt_position current_position = mlt_producer_frame( producer );
+
+	// Frame is taken right away, so other producers can't evict it meanwhile.
+	// Frame cache has its own lock, so cached frames don't wait for requests in flight.
+	mlt_frame frame = producer_cached_frame( self, current_position );
+
+	pthread_mutex_lock( &self->cache_mutex );
+
+	// Playing backwards (or stepping back frame by frame) is served from chunks
+	// decoded ahead of the playhead, going backwards
+	double speed = mlt_producer_get_speed( producer );
+	int reverse = speed < 0 || ( speed == 0 && current_position == self->latest_request_position - 1 );
+	int chunk_size = mlt_properties_get_int( properties, "reverse_chunk_size" );
+	if ( chunk_size < 1 )
+		chunk_size = 1;
+
+	// Frames we're about to play must stay in cache until we get them,
+	// including those other requests in flight wait for
+	int read_ahead = producer_read_ahead( self );
+	if ( reverse )
+		frame_cache_protect( self->cache, current_position - 2 * chunk_size, current_position );
+	else
+		frame_cache_protect( self->cache, requests_window_start( self, current_position ), current_position + read_ahead );
+
+	if ( frame == NULL )
+		frame = producer_cached_frame( self, current_position );
+
+	self->latest_request_time = wall_clock_time( );
+	self->prerolled = 0;
+	// Out point may have moved since the last request, decoding follows it
+	self->decode_out_position = mlt_producer_get_out( producer ) + OUT_POINT_MARGIN;
+
+	// Switching proxy scale (e.g. back to full resolution when scrubbing stops)
+	// needs a new media player, frames decoded at the old scale go away with it.
+	// So does going back from the end of media, ended player doesn't seek.
+	int restart = proxy_scale_from_properties( properties ) != self->proxy_scale;
+	if ( frame == NULL && self->ended && ( self->end_position == -1 || current_position < self->end_position ) )
+		restart = 1;
+	if ( self->started && restart )
+	{
+		if ( frame != NULL )
+			mlt_frame_close( frame );
+		frame = NULL;
+		libvlc_media_player_t *media_player = decoder_hibernate( self );
+
+		// Packer thread ends, once it sees decoder stopped. Nobody else joins it,
+		// and other requests wait in decoder_start() until we release the player.
+		pthread_t packer = self->packer_thread;
+		self->packer_started = 0;
+		pthread_mutex_unlock( &self->cache_mutex );
+		packer_wake( self );
+		pthread_join( packer, NULL );
+		decoder_release( self, media_player );
+		pthread_mutex_lock( &self->cache_mutex );
+	}
+
+	// Another producer of the same media may have decoded it already
+	if ( frame == NULL )
+	{
+		frame = shared_cache_get_frame( shared_cache_key( self ), current_position, MLT_PRODUCER_SERVICE( producer ) );
+		int proxy_scale = proxy_scale_from_properties( properties );
+		if ( frame != NULL && proxy_scale > 1 )
+			mlt_properties_set_int( MLT_FRAME_PROPERTIES( frame ), "proxy_scale", proxy_scale );
+	}
+
+	// Nothing past the end of media ever gets decoded
+	if ( frame == NULL && self->end_position != -1 && current_position >= self->end_position )
+	{
+		mlt_log( MLT_PRODUCER_SERVICE( producer ), MLT_LOG_DEBUG,
+			"producer_get_frame: %d is past the end of media at %d\n", current_position, self->end_position );
+		int error = producer_error_frame( self, frame_ptr, current_position );
+		mlt_producer_prepare_next( producer );
+		pthread_mutex_unlock( &self->cache_mutex );
+		return error;
+	}
+
+	if ( frame == NULL && !self->started && decoder_start( self, current_position ) )
+	{
+		int error = producer_error_frame( self, frame_ptr, current_position );
+		pthread_mutex_unlock( &self->cache_mutex );
+		return error;
+	}
+
+	if ( frame == NULL )
+	{
+		decoder_request( self, current_position, reverse );
+
+		// Packer thread signals us, when it puts our frame into cache
+		struct frame_waiter_s waiter;
+		waiter.position = current_position;
+		pthread_cond_init( &waiter.cond, NULL );
+		waiter.next = self->waiters;
+		self->waiters = &waiter;
+
+		// Nothing gets packed during seek, so we look at the playhead now and then
+		double fps = mlt_properties_get_double( properties, "_fps" );
+		int64_t timeout = 1000000.0 / fps + 0.5;
+		int scrub_distance = read_ahead > chunk_size ? read_ahead : chunk_size;
+		int superseded = 0;
+
+		while ( !( frame = producer_cached_frame( self, waiter.position ) ) )
+		{
+			// Nothing more is coming, once producer closes or decoder got to the end of media
+			if ( self->terminating || self->ended )
+				break;
+
+			// Cache may have room for frames VLC gave us while pausing
+			packer_wake( self );
+
+			struct timespec deadline;
+			clock_gettime( CLOCK_REALTIME, &deadline );
+			deadline.tv_nsec += timeout * 1000;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			pthread_cond_timedwait( &waiter.cond, &self->cache_mutex, &deadline );
+
+			// User dragging the scrubber moves the playhead far from what we wait for
+			// (parallel requests only move it around). Then decoder goes straight for
+			// the latest position, which MLT requests next, and this request fails.
+			// Positions dragged over meanwhile are never decoded.
+			mlt_position playhead = mlt_producer_frame( producer );
+			if ( playhead > waiter.position + scrub_distance || playhead < waiter.position - scrub_distance )
+			{
+				mlt_log( MLT_PRODUCER_SERVICE( producer ), MLT_LOG_DEBUG,
+					"producer_get_frame: request for %d superseded by %d\n", waiter.position, playhead );
+				self->next_request_position = playhead;
+				if ( reverse )
+					frame_cache_protect( self->cache, playhead - 2 * chunk_size, playhead );
+				else
+					frame_cache_protect( self->cache, requests_window_start( self, playhead ), playhead + read_ahead );
+				if ( !frame_cache_contains( self->cache, playhead ) )
+					decoder_request( self, playhead, reverse );
+				superseded = 1;
+				break;
+			}
+		}
+
+		frame_waiter *link = &self->waiters;
+		while ( *link != &waiter )
+			link = &( *link )->next;
+		*link = waiter.next;
+		pthread_cond_destroy( &waiter.cond );
+
+		if ( frame == NULL )
+		{
+			// Closing producer frees everything once we're gone, we don't touch it after unlock
+			mlt_log( MLT_PRODUCER_SERVICE( producer ), MLT_LOG_DEBUG, "producer_get_frame: no frame for %d, %s\n",
+				current_position, self->terminating ? "producer is closing" : superseded ? "superseded" : "media ended" );
+			int error = producer_error_frame( self, frame_ptr, current_position );
+			// Playhead somebody moved away isn't ours to advance
+			if ( !self->terminating && !superseded )
+				mlt_producer_prepare_next( producer );
+			if ( self->terminating && self->waiters == NULL )
+				pthread_cond_broadcast( &self->waiters_cond );
+			pthread_mutex_unlock( &self->cache_mutex );
+			return error;
+		}
+	}
+
+	// Cached frames are keyed by media position, MLT gets one relative to in point
+	mlt_frame_set_position( frame, mlt_producer_position( producer ) );
+	*frame_ptr = frame;
+	self->latest_request_position = current_position;
+
+	// Prepare next frame
+	mlt_producer_prepare_next( producer );
+	self->next_request_position = mlt_producer_frame( producer );
+
+	// While MLT plays reverse chunk from cache, VLC decodes the one preceding it
+	if ( reverse && self->started && self->reverse && !self->during_seek && self->decoder_position > self->decode_stop_position )
+	{
+		mlt_position chunk_end = self->seek_request_position - 1;
+		mlt_position chunk_start = chunk_end - chunk_size + 1;
+		if ( chunk_end >= 0 && !frame_cache_contains( self->cache, chunk_end ) )
+			decoder_seek( self, chunk_start > 0 ? chunk_start : 0, chunk_end, 1 );
+	}
+
+	pthread_mutex_unlock( &self->cache_mutex );
+
+	// Now, that we've moved on, there's room in cache for next frame
+	packer_wake( self );
+	return 0;
+}
+
+// Creates batch_lanes lanes, producers of the same media, each with its own media
+// player. They're kept running (no hibernation), as they decode ahead of requests.
+// Single media player isn't paced, but it's a single pipeline: demuxing, transcode
+// (conversion and scaling) and packing each run on one thread, and decoders thread
+// only as far as their codec allows. Lanes run several pipelines at once.
+// WARNING: Lock cache_mutex before calling this function
+static int batch_start( producer_libvlc self )
+{
+	mlt_producer producer = self->parent;
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( producer );
+
+	int count = mlt_properties_get_int( properties, "batch_lanes" );
+	int segment_size = mlt_properties_get_int( properties, "batch_segment_size" );
+	if ( segment_size < 1 )
+		segment_size = 1;
+
+	batch_lane lanes = calloc( count, sizeof( struct batch_lane_s ) );
+	if ( lanes == NULL )
+		return 1;
+
+	int i;
+	for ( i = 0; i < count; i++ )
+	{
+		mlt_producer lane = producer_libvlc_init( mlt_service_profile( MLT_PRODUCER_SERVICE( producer ) ),
+			producer_type, "libvlc", mlt_properties_get( properties, "resource" ) );
+		if ( lane == NULL )
+			goto cleanup;
+		lanes[ i ].producer = lane;
+		lanes[ i ].segment = -1;
+		pthread_mutex_init( &lanes[ i ].mutex, NULL );
+
+		// Lane positions are the same as ours
+		mlt_properties lane_properties = MLT_PRODUCER_PROPERTIES( lane );
+		mlt_properties_pass_list( lane_properties, properties, "audio_only,video_only,proxy_scale,video_pool_size,length" );
+		mlt_producer_set_in_and_out( lane, mlt_producer_get_in( producer ), mlt_producer_get_out( producer ) );
+		mlt_producer_set_speed( lane, 1.0 );
+
+		// Whole segment gets decoded ahead, and stays until it's requested
+		mlt_properties_set_int( lane_properties, "read_ahead", segment_size );
+		mlt_properties_set_int( lane_properties, "idle_timeout", 0 );
+		mlt_properties_set_int( lane_properties, "_batch_lane", 1 );
+	}
+
+	mlt_log( MLT_PRODUCER_SERVICE( producer ), MLT_LOG_VERBOSE, "batch_start: decoding on %d lanes\n", count );
+	self->lanes = lanes;
+	self->lane_count = count;
+	self->segment_size = segment_size;
+	return 0;
+
+cleanup:
+	while ( i-- > 0 )
+	{
+		mlt_producer_close( lanes[ i ].producer );
+		pthread_mutex_destroy( &lanes[ i ].mutex );
+	}
+	free( lanes );
+	return 1;
+}
+
+static void batch_close( producer_libvlc self )
+{
+	int i;
+	for ( i = 0; i < self->lane_count; i++ )
+	{
+		mlt_producer_close( self->lanes[ i ].producer );
+		pthread_mutex_destroy( &self->lanes[ i ].mutex );
+	}
+	free( self->lanes );
+	self->lanes = NULL;
+	self->lane_count = 0;
+}
+
+// Peak file is made from a producer of its own, decoding audio only from start
+// to end, so our decoder keeps serving requests meanwhile
+static void *waveform_thread( void *data )
+{
+	producer_libvlc self = data;
+	mlt_producer producer = self->parent;
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( producer );
+
+	mlt_producer source = producer_libvlc_init( mlt_service_profile( MLT_PRODUCER_SERVICE( producer ) ),
+		producer_type, "libvlc", mlt_properties_get( properties, "resource" ) );
+	if ( source == NULL )
+		return NULL;
+
+	// Whole media is decoded, whatever our length is. Without duration probed,
+	// source goes on (up to a day) until it gets to the end of media.
+	mlt_properties source_properties = MLT_PRODUCER_PROPERTIES( source );
+	double fps = mlt_producer_get_fps( producer );
+	int64_t duration = mlt_properties_get_int64( source_properties, "_media_duration" );
+	mlt_position length = ( mlt_position )ceil( ( duration > 0 ? duration / 1000.0 : 86400.0 ) * fps );
+	mlt_properties_pass_list( source_properties, properties, "channels,frequency" );
+	mlt_properties_set_int( source_properties, "audio_only", 1 );
+	mlt_properties_set_position( source_properties, "length", length );
+	mlt_producer_set_in_and_out( source, 0, length - 1 );
+	mlt_producer_set_speed( source, 1.0 );
+	// Requests come one after another until the end, no point in hibernating
+	mlt_properties_set_int( source_properties, "idle_timeout", 0 );
+
+	// 100 peaks per second, unless set otherwise
+	int samples_per_peak = mlt_properties_get_int( properties, "waveform_samples_per_peak" );
+	if ( samples_per_peak < 1 )
+		samples_per_peak = mlt_properties_get_int( properties, "frequency" ) / 100;
+
+	int error = waveform_generate( source, mlt_properties_get( properties, "_waveform_file" ), samples_per_peak, &self->waveform_cancel );
+	mlt_producer_close( source );
+
+	if ( !error )
+		mlt_events_fire( properties, "waveform-ready", NULL );
+	else if ( !__atomic_load_n( &self->waveform_cancel, __ATOMIC_ACQUIRE ) )
+		mlt_log( MLT_PRODUCER_SERVICE( producer ), MLT_LOG_WARNING, "waveform_thread: failed to write %s\n",
+			mlt_properties_get( properties, "_waveform_file" ) );
+	return NULL;
+}
+
+// Starts generating peak file of waveform_file, cancelling generation of the previous one
+static void waveform_start( producer_libvlc self )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	waveform_stop( self );
+	if ( mlt_properties_get( properties, "waveform_file" ) == NULL )
+		return;
+
+	// Thread works with a snapshot, waveform_file may change under it
+	mlt_properties_set( properties, "_waveform_file", mlt_properties_get( properties, "waveform_file" ) );
+	self->waveform_cancel = 0;
+	if ( pthread_create( &self->waveform_thread, NULL, waveform_thread, self ) == 0 )
+		self->waveform_started = 1;
+}
+
+static void waveform_stop( producer_libvlc self )
+{
+	if ( !self->waveform_started )
+		return;
+
+	__atomic_store_n( &self->waveform_cancel, 1, __ATOMIC_RELEASE );
+	pthread_join( self->waveform_thread, NULL );
+	self->waveform_started = 0;
+}
+
+// Application opening a project probes its other media ahead, so their
+// producers find metadata in cache
+static void *probe_thread( void *data )
+{
+	producer_libvlc self = data;
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	char *list = strdup( mlt_properties_get( properties, "_probe_files" ) );
+	if ( list == NULL )
+		return NULL;
+
+	// One path per line
+	int count = 1;
+	char *c;
+	for ( c = list; *c; c++ )
+		count += *c == '\n';
+	const char **paths = malloc( count * sizeof( char * ) );
+	if ( paths == NULL )
+	{
+		free( list );
+		return NULL;
+	}
+	count = 0;
+	char *path;
+	char *saveptr = NULL;
+	for ( path = strtok_r( list, "\n", &saveptr ); path != NULL; path = strtok_r( NULL, "\n", &saveptr ) )
+		paths[ count++ ] = path;
+
+	int workers = mlt_properties_get_int( properties, "probe_workers" );
+	if ( workers < 1 )
+		workers = sysconf( _SC_NPROCESSORS_ONLN );
+
+	int probed = media_probe_batch( paths, count, workers, &self->probe_cancel );
+	mlt_log( MLT_PRODUCER_SERVICE( self->parent ), MLT_LOG_VERBOSE, "probe_thread: probed %d of %d files\n", probed, count );
+
+	free( paths );
+	free( list );
+	return NULL;
+}
+
+// Starts probing probe_files, cancelling probing of the previous ones
+static void probe_start( producer_libvlc self )
+{
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( self->parent );
+
+	probe_stop( self );
+	if ( mlt_properties_get( properties, "probe_files" ) == NULL )
+		return;
+
+	// Thread works with a snapshot, probe_files may change under it
+	mlt_properties_set( properties, "_probe_files", mlt_properties_get( properties, "probe_files" ) );
+	self->probe_cancel = 0;
+	if ( pthread_create( &self->probe_thread, NULL, probe_thread, self ) == 0 )
+		self->probe_started = 1;
+}
+
+static void probe_stop( producer_libvlc self )
+{
+	if ( !self->probe_started )
+		return;
+
+	__atomic_store_n( &self->probe_cancel, 1, __ATOMIC_RELEASE );
+	pthread_join( self->probe_thread, NULL );
+	self->probe_started = 0;
+}
+
+// Batch mode splits in/out range into segments, which lanes decode in parallel,
+// lane i taking segments i, i + lane_count and so on. Frames are requested
+// from lane decoding the segment, while the rest decode segments that follow.
+static int producer_get_batch_frame( mlt_producer producer, mlt_frame_ptr frame_ptr, int index )
+{
+	producer_libvlc self = producer->child;
+
+	// Segments are counted from in point, lanes decode media positions
+	mlt_position position = mlt_producer_position( producer );
+	mlt_position in = mlt_producer_get_in( producer );
+	mlt_position last = mlt_producer_get_playtime( producer ) - 1;
+	int segment = position > 0 ? position / self->segment_size : 0;
+
+	pthread_mutex_lock( &self->cache_mutex );
+	int i;
+	for ( i = 0; i < self->lane_count; i++ )
+	{
+		batch_lane lane = &self->lanes[ ( segment + i ) % self->lane_count ];
+		mlt_position start = ( mlt_position )( segment + i ) * self->segment_size;
+		if ( lane->segment == segment + i || ( i > 0 && start > last ) )
+			continue;
+
+		lane->segment = segment + i;
+		mlt_position end = start + self->segment_size - 1;
+		if ( end > last && last >= start )
+			end = last;
+		decoder_prefetch( lane->producer->child, in + start, in + end );
+	}
+	batch_lane lane = &self->lanes[ segment % self->lane_count ];
+	pthread_mutex_unlock( &self->cache_mutex );
+
+	pthread_mutex_lock( &lane->mutex );
+	mlt_producer_seek( lane->producer, position );
+	int error = mlt_service_get_frame( MLT_PRODUCER_SERVICE( lane->producer ), frame_ptr, index );
+	pthread_mutex_unlock( &lane->mutex );
+
+	// Prepare next frame
+	mlt_producer_prepare_next( producer );
+
+	return error;
+}
+
+// Thumbnail mode delivers a whole strip of thumbnails in each frame, decoded by
+// thumbnailer's own media player. Frame cache isn't used at all.
+static int producer_get_strip( mlt_producer producer, mlt_frame_ptr frame_ptr, int index )
+{
+	producer_libvlc self = producer->child;
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( producer );
+
+	int count = mlt_properties_get_int( properties, "thumbnail_count" );
+	if ( count < 1 )
+		count = 1;
+
+	pthread_mutex_lock( &self->cache_mutex );
+
+	// Thumbnail size is fixed, once VLC gets set up to scale pictures to it
+	if ( self->thumbnailer == NULL )
+	{
+		int width = mlt_properties_get_int( properties, "thumbnail_width" );
+		int height = mlt_properties_get_int( properties, "thumbnail_height" );
+		if ( width < 2 )
+			width = 160;
+		if ( height < 2 )
+		{
+			double media_width = mlt_properties_get_int( properties, "meta.media.width" );
+			double media_height = mlt_properties_get_int( properties, "meta.media.height" );
+			int sar_num = mlt_properties_get_int( properties, "meta.media.sample_aspect_num" );
+			int sar_den = mlt_properties_get_int( properties, "meta.media.sample_aspect_den" );
+			if ( sar_num > 0 && sar_den > 0 )
+				media_width = media_width * sar_num / sar_den;
+			height = media_width > 0 && media_height > 0 ? width * media_height / media_width : width * 9 / 16;
+			height += height & 1;
+		}
+		mlt_properties_set_int( properties, "_thumbnail_width", width );
+		mlt_properties_set_int( properties, "_thumbnail_height", height );
+
+		self->thumbnailer = thumbnailer_init( self->vlc, mlt_properties_get( properties, "resource" ), width, height );
+		if ( self->thumbnailer == NULL )
+		{
+			pthread_mutex_unlock( &self->cache_mutex );
+			*frame_ptr = NULL;
+			return 1;
+		}
+	}
+
+	int width = mlt_properties_get_int( properties, "_thumbnail_width" );
+	int height = mlt_properties_get_int( properties, "_thumbnail_height" );
+	int size = count * width * height * 3;
+	uint8_t *strip = mlt_pool_alloc( size );
+	int delivered = strip != NULL ? thumbnailer_strip( self->thumbnailer, count, strip ) : 0;
+
+	pthread_mutex_unlock( &self->cache_mutex );
+
+	mlt_frame frame = mlt_frame_init( MLT_PRODUCER_SERVICE( producer ) );
+	if ( frame == NULL || strip == NULL )
+	{
+		mlt_frame_close( frame );
+		mlt_pool_release( strip );
+		*frame_ptr = NULL;
+		return 1;
+	}
+
+	mlt_properties frame_properties = MLT_FRAME_PROPERTIES( frame );
+	mlt_properties_set_data( frame_properties, "_strip_image", strip, size, mlt_pool_release, NULL );
+	mlt_properties_set_int( frame_properties, "format", mlt_image_rgb24 );
+	mlt_properties_set_int( frame_properties, "width", count * width );
+	mlt_properties_set_int( frame_properties, "height", height );
+	mlt_properties_set_int( frame_properties, "thumbnail_count", count );
+	mlt_properties_set_int( frame_properties, "thumbnail_width", width );
+	mlt_properties_set_int( frame_properties, "thumbnails_delivered", delivered );
+	mlt_frame_set_position( frame, mlt_producer_position( producer ) );
+	mlt_frame_push_get_image( frame, producer_get_strip_image );
+
+	*frame_ptr = frame;
+	mlt_producer_prepare_next( producer );
+	return 0;
+}
+
+static int producer_get_strip_image( mlt_frame frame, uint8_t **buffer, mlt_image_format *format, int *width, int *height, int writable )
+{
+	mlt_properties frame_properties = MLT_FRAME_PROPERTIES( frame );
+
+	int size = 0;
+	uint8_t *image = mlt_properties_get_data( frame_properties, "_strip_image", &size );
+	if ( image == NULL )
+		return 1;
+
+	*width = mlt_properties_get_int( frame_properties, "width" );
+	*height = mlt_properties_get_int( frame_properties, "height" );
+
+	// Strip stays owned by "_strip_image" property
+	mlt_frame_set_image( frame, image, size, NULL );
+	*buffer = image;
+
+	mlt_image_format requested_format = *format;
+	*format = mlt_image_rgb24;
+	if ( requested_format != mlt_image_none && requested_format != mlt_image_rgb24 && frame->convert_image != NULL )
+	{
+		if ( frame->convert_image( frame, buffer, format, requested_format ) )
+			*format = mlt_image_rgb24;
+	}
+
+	return 0;
+}
+
+static void producer_close( mlt_producer parent )
+{
+	if ( parent != NULL ) {
+		producer_libvlc self = parent->child;
+
+		waveform_stop( self );
+		probe_stop( self );
+		batch_close( self );
+
+		// Stop VLC threads, they won't wait for packer thread anymore
+		pthread_mutex_lock( &self->cache_mutex );
+		__atomic_store_n( &self->terminating, 1, __ATOMIC_RELEASE );
+		// Requests in flight give up, we free nothing until they're gone
+		while ( self->waiters != NULL )
+		{
+			frame_waiter waiter;
+			for ( waiter = self->waiters; waiter != NULL; waiter = waiter->next )
+				pthread_cond_signal( &waiter->cond );
+			pthread_cond_wait( &self->waiters_cond, &self->cache_mutex );
+		}
+		pthread_mutex_unlock( &self->cache_mutex );
+		if ( self->media_player )
+			libvlc_media_player_stop( self->media_player );
+
+		// Stop packer thread (or join one, which ended hibernating)
+		if ( self->packer_started )
+		{
+			packer_wake( self );
+			pthread_join( self->packer_thread, NULL );
+		}
+
+		// Release whatever VLC has queued since
+		struct decoded_item_s item;
+		while ( self->audio_queue != NULL && !spsc_queue_pop( self->audio_queue, &item ) )
+			packer_release( &item );
+		while ( self->video_queue != NULL && !spsc_queue_pop( self->video_queue, &item ) )
+			packer_release( &item );
+		spsc_queue_close( self->audio_queue );
+		spsc_queue_close( self->video_queue );
+
+		if ( self->shared_cache_registered )
+			shared_cache_unregister( mlt_properties_get( MLT_PRODUCER_PROPERTIES( parent ), "_shared_cache_key" ) );
+
+		// Release libVLC objects
+		thumbnailer_close( self->thumbnailer );
+		cleanup_vlc( self );
+
+		// Frames still referenced elsewhere keep video pool alive
+		buffer_queue_close( self->bqueue );
+		frame_cache_close( self->cache );
+		slab_pool_close( self->video_pool );
+		free( self->fallback_buffer );
+		keyframe_index_close( self->kf_index );
 
 		// Clear mutexes and conds
 		pthread_mutex_destroy( &self->cache_mutex );
-		pthread_cond_destroy( &self->cache_cond );
+		pthread_mutex_destroy( &self->packer_mutex );
+		pthread_cond_destroy( &self->packer_cond );
+		pthread_cond_destroy( &self->stopped_cond );
+		pthread_cond_destroy( &self->waiters_cond );
 
 		// Free allocated memory for libvlc_producer
 		free( self );
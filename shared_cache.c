@@ -0,0 +1,318 @@
+/*
+Process-wide cache of decoded frames.
+
+The same media often appears on a timeline several times (multicam,
+repeated cutaways, split edits), each time with a producer of its own.
+Producers publish frames they pack here, keyed by a string describing
+media and the format it was decoded in, plus media position. Producers
+of the same media look here before decoding, so they share frames
+(and decode work) instead of each of them decoding its own copy.
+
+Cache keeps decoded data of frames only (see buffer_queue_snapshot_init()),
+each hit gets a fresh frame of the producer asking, so frame properties,
+services and filters of one producer never leak into another. Pictures are
+shared by reference (and copied before anyone writes to them), audio gets
+copied, it's small. When cache goes over its memory budget, the least
+recently used frames are dropped.
+
+Producers register the key they decode under while they're decoding.
+Frames get published only when another producer decodes under the same
+key, or once an application sets the budget (frame_cache_shared_size),
+so a single producer of its media doesn't pay for snapshots nobody
+takes. Memory of published frames counts against the process-wide frame
+cache budget too (frame_cache_global_reserve()). Pictures a producer's
+frame cache holds as well are counted twice, erring on the side of using
+less memory.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <framework/mlt_frame.h>
+#include <framework/mlt_types.h>
+
+#include "buffer_queue.h"
+#include "frame_cache.h"
+#include "shared_cache.h"
+
+// Default memory budget of the cache
+#define SHARED_CACHE_DEFAULT_SIZE 268435456
+// Number of hash table buckets
+#define SHARED_CACHE_BUCKETS 1024
+
+struct shared_cache_entry_s
+{
+	char *key;
+	mlt_position position;
+	uint32_t hash;
+	buffer_queue_snapshot snapshot;
+	// Memory taken by snapshot
+	size_t size;
+	// Next entry in hash bucket
+	struct shared_cache_entry_s *next;
+	// Neighbours in use order (most recently used first)
+	struct shared_cache_entry_s *newer;
+	struct shared_cache_entry_s *older;
+};
+
+typedef struct shared_cache_entry_s *shared_cache_entry;
+
+// Key producers decode under, with number of them
+struct shared_cache_user_s
+{
+	char *key;
+	int count;
+	struct shared_cache_user_s *next;
+};
+
+typedef struct shared_cache_user_s *shared_cache_user;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shared_cache_entry buckets[ SHARED_CACHE_BUCKETS ];
+static shared_cache_entry newest = NULL;
+static shared_cache_entry oldest = NULL;
+// Memory taken by frames in cache currently
+static size_t cache_size = 0;
+static size_t cache_size_max = SHARED_CACHE_DEFAULT_SIZE;
+// Set once budget is set explicitly, frames get published with a single producer too
+static int sharing_enabled = 0;
+static shared_cache_user users = NULL;
+
+// FNV-1a of key, mixed with position
+static uint32_t shared_cache_hash( const char *key, mlt_position position )
+{
+	uint32_t hash = 2166136261u;
+	while ( *key )
+	{
+		hash ^= ( uint8_t )*key++;
+		hash *= 16777619u;
+	}
+	hash ^= ( uint32_t )position;
+	hash *= 16777619u;
+	return hash;
+}
+
+static shared_cache_entry shared_cache_find( const char *key, mlt_position position, uint32_t hash )
+{
+	shared_cache_entry entry;
+	for ( entry = buckets[ hash % SHARED_CACHE_BUCKETS ]; entry != NULL; entry = entry->next )
+		if ( entry->hash == hash && entry->position == position && !strcmp( entry->key, key ) )
+			return entry;
+	return NULL;
+}
+
+static void shared_cache_unlink( shared_cache_entry entry )
+{
+	if ( entry->newer )
+		entry->newer->older = entry->older;
+	else
+		newest = entry->older;
+	if ( entry->older )
+		entry->older->newer = entry->newer;
+	else
+		oldest = entry->newer;
+	entry->newer = entry->older = NULL;
+}
+
+static void shared_cache_link_newest( shared_cache_entry entry )
+{
+	entry->older = newest;
+	entry->newer = NULL;
+	if ( newest )
+		newest->newer = entry;
+	else
+		oldest = entry;
+	newest = entry;
+}
+
+// Takes the least recently used entries out of cache, until it fits its budget.
+// They're returned chained through next, so snapshots get closed without holding lock.
+// WARNING: Lock cache_mutex before calling this function
+static shared_cache_entry shared_cache_evict( )
+{
+	shared_cache_entry evicted = NULL;
+	while ( oldest != NULL && cache_size > cache_size_max )
+	{
+		shared_cache_entry entry = oldest;
+		shared_cache_unlink( entry );
+
+		shared_cache_entry *link = &buckets[ entry->hash % SHARED_CACHE_BUCKETS ];
+		while ( *link != entry )
+			link = &( *link )->next;
+		*link = entry->next;
+
+		cache_size -= entry->size;
+		entry->next = evicted;
+		evicted = entry;
+	}
+	return evicted;
+}
+
+// Closes chain of entries. Those evicted from cache give their memory back
+// to process-wide frame cache budget.
+static void shared_cache_release( shared_cache_entry entry, int evicted )
+{
+	size_t size = 0;
+	while ( entry != NULL )
+	{
+		shared_cache_entry next = entry->next;
+		size += entry->size;
+		buffer_queue_snapshot_close( entry->snapshot );
+		free( entry->key );
+		free( entry );
+		entry = next;
+	}
+	if ( evicted )
+		frame_cache_global_release( size );
+}
+
+// WARNING: Lock cache_mutex before calling this function
+static shared_cache_user shared_cache_find_user( const char *key )
+{
+	shared_cache_user user;
+	for ( user = users; user != NULL; user = user->next )
+		if ( !strcmp( user->key, key ) )
+			return user;
+	return NULL;
+}
+
+void shared_cache_set_size( size_t size_max )
+{
+	pthread_mutex_lock( &cache_mutex );
+	cache_size_max = size_max;
+	sharing_enabled = size_max > 0;
+	shared_cache_entry evicted = shared_cache_evict( );
+	pthread_mutex_unlock( &cache_mutex );
+
+	shared_cache_release( evicted, 1 );
+}
+
+// Producer starts decoding under key
+void shared_cache_register( const char *key )
+{
+	if ( key == NULL )
+		return;
+
+	pthread_mutex_lock( &cache_mutex );
+	shared_cache_user user = shared_cache_find_user( key );
+	if ( user == NULL && ( user = calloc( 1, sizeof( struct shared_cache_user_s ) ) ) != NULL )
+	{
+		user->key = strdup( key );
+		if ( user->key == NULL )
+		{
+			free( user );
+			user = NULL;
+		}
+		else
+		{
+			user->next = users;
+			users = user;
+		}
+	}
+	if ( user != NULL )
+		user->count++;
+	pthread_mutex_unlock( &cache_mutex );
+}
+
+// Producer stops decoding under key. Frames published already stay.
+void shared_cache_unregister( const char *key )
+{
+	if ( key == NULL )
+		return;
+
+	pthread_mutex_lock( &cache_mutex );
+	shared_cache_user *link;
+	for ( link = &users; *link != NULL; link = &( *link )->next )
+	{
+		shared_cache_user user = *link;
+		if ( strcmp( user->key, key ) )
+			continue;
+		if ( --user->count == 0 )
+		{
+			*link = user->next;
+			free( user->key );
+			free( user );
+		}
+		break;
+	}
+	pthread_mutex_unlock( &cache_mutex );
+}
+
+mlt_frame shared_cache_get_frame( const char *key, mlt_position position, mlt_service owner )
+{
+	mlt_frame frame = NULL;
+
+	if ( key == NULL )
+		return frame;
+
+	uint32_t hash = shared_cache_hash( key, position );
+
+	pthread_mutex_lock( &cache_mutex );
+	shared_cache_entry entry = shared_cache_find( key, position, hash );
+	if ( entry != NULL )
+	{
+		shared_cache_unlink( entry );
+		shared_cache_link_newest( entry );
+		// Frame holds its own references, snapshot can go any time after
+		frame = buffer_queue_snapshot_frame( entry->snapshot, owner, position );
+	}
+	pthread_mutex_unlock( &cache_mutex );
+
+	return frame;
+}
+
+void shared_cache_put_frame( const char *key, mlt_position position, mlt_frame frame )
+{
+	if ( key == NULL || frame == NULL )
+		return;
+
+	uint32_t hash = shared_cache_hash( key, position );
+
+	// Frames nobody else would take aren't published, and another producer
+	// of the same media may have got there first
+	pthread_mutex_lock( &cache_mutex );
+	shared_cache_user user = shared_cache_find_user( key );
+	int skip = cache_size_max == 0 || ( !sharing_enabled && ( user == NULL || user->count < 2 ) ) ||
+		shared_cache_find( key, position, hash ) != NULL;
+	pthread_mutex_unlock( &cache_mutex );
+	if ( skip )
+		return;
+
+	shared_cache_entry entry = calloc( 1, sizeof( struct shared_cache_entry_s ) );
+	if ( entry == NULL || ( entry->key = strdup( key ) ) == NULL ||
+		 ( entry->snapshot = buffer_queue_snapshot_init( frame ) ) == NULL )
+	{
+		if ( entry )
+			free( entry->key );
+		free( entry );
+		return;
+	}
+	entry->position = position;
+	entry->hash = hash;
+	entry->size = buffer_queue_snapshot_size( entry->snapshot );
+
+	pthread_mutex_lock( &cache_mutex );
+
+	// Check again, snapshot was taken without lock (and frames bigger than
+	// the whole budget aren't worth it)
+	if ( entry->size > cache_size_max || shared_cache_find( key, position, hash ) != NULL )
+	{
+		pthread_mutex_unlock( &cache_mutex );
+		shared_cache_release( entry, 0 );
+		return;
+	}
+
+	entry->next = buckets[ hash % SHARED_CACHE_BUCKETS ];
+	buckets[ hash % SHARED_CACHE_BUCKETS ] = entry;
+	shared_cache_link_newest( entry );
+	cache_size += entry->size;
+	size_t size = entry->size;
+
+	shared_cache_entry evicted = shared_cache_evict( );
+	pthread_mutex_unlock( &cache_mutex );
+
+	// Frame caches of all producers make room for it, if needed
+	frame_cache_global_reserve( size );
+	shared_cache_release( evicted, 1 );
+}
@@ -0,0 +1,12 @@
+#ifndef SHARED_CACHE_H
+#define SHARED_CACHE_H
+
+#include <framework/mlt_frame.h>
+
+extern void shared_cache_set_size( size_t size_max );
+extern void shared_cache_register( const char *key );
+extern void shared_cache_unregister( const char *key );
+extern mlt_frame shared_cache_get_frame( const char *key, mlt_position position, mlt_service owner );
+extern void shared_cache_put_frame( const char *key, mlt_position position, mlt_frame frame );
+
+#endif
@@ -0,0 +1,188 @@
+/*
+Recycling pool of fixed size, page aligned buffers.
+
+Decoded pictures all have the same size and come at frame rate,
+so instead of going to allocator for each of them, we keep
+released slabs around and hand them out again. Up to high_water_mark
+idle slabs are kept, the rest gets freed.
+
+Each slab remembers its pool, so slab_pool_release can be used
+directly as mlt_destructor. Pool stays alive until its owner closed
+it and all slabs got released.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "slab_pool.h"
+
+struct slab_header_s
+{
+	// Pool slab belongs to
+	slab_pool pool;
+	// Size of slab data
+	size_t size;
+	// Next idle slab
+	struct slab_header_s *next;
+};
+
+typedef struct slab_header_s *slab_header;
+
+struct slab_pool_s
+{
+	pthread_mutex_t mutex;
+	// Size of slabs handed out
+	size_t slab_size;
+	// Space reserved for header, so slab data is page aligned
+	size_t header_size;
+	// Alignment of slabs
+	size_t alignment;
+	// Stack of idle slabs
+	slab_header idle;
+	// Number of idle slabs
+	int idle_count;
+	// Maximum number of idle slabs kept
+	int high_water_mark;
+	// Owner's reference plus one for every slab handed out
+	int ref_count;
+};
+
+static slab_header slab_pool_header( void *slab )
+{
+	return *( ( slab_header * )slab - 1 );
+}
+
+slab_pool slab_pool_init( size_t slab_size, int high_water_mark )
+{
+	slab_pool self = calloc( 1, sizeof( struct slab_pool_s ) );
+	if ( self == NULL )
+		return NULL;
+
+	if ( pthread_mutex_init( &self->mutex, NULL ) != 0 )
+	{
+		free( self );
+		return NULL;
+	}
+
+	long page_size = sysconf( _SC_PAGESIZE );
+	self->alignment = page_size > 0 ? page_size : 4096;
+	self->header_size = self->alignment;
+	self->slab_size = slab_size;
+	self->high_water_mark = high_water_mark;
+	self->ref_count = 1;
+
+	return self;
+}
+
+static void slab_pool_free_idle( slab_pool self )
+{
+	while ( self->idle != NULL )
+	{
+		slab_header header = self->idle;
+		self->idle = header->next;
+		free( header );
+	}
+	self->idle_count = 0;
+}
+
+static void slab_pool_unref( slab_pool self )
+{
+	// Called with mutex held, returns with it released
+	int ref_count = --self->ref_count;
+	pthread_mutex_unlock( &self->mutex );
+
+	if ( ref_count == 0 )
+	{
+		slab_pool_free_idle( self );
+		pthread_mutex_destroy( &self->mutex );
+		free( self );
+	}
+}
+
+void *slab_pool_alloc( slab_pool self )
+{
+	if ( self == NULL )
+		return NULL;
+
+	pthread_mutex_lock( &self->mutex );
+
+	slab_header header = self->idle;
+	if ( header != NULL )
+	{
+		self->idle = header->next;
+		self->idle_count--;
+	}
+	else
+	{
+		void *memory = NULL;
+		if ( posix_memalign( &memory, self->alignment, self->header_size + self->slab_size ) != 0 )
+		{
+			pthread_mutex_unlock( &self->mutex );
+			return NULL;
+		}
+		header = memory;
+		header->pool = self;
+		header->size = self->slab_size;
+	}
+	header->next = NULL;
+	self->ref_count++;
+
+	pthread_mutex_unlock( &self->mutex );
+
+	uint8_t *slab = ( uint8_t * )header + self->header_size;
+	// Header may be far from data, so we keep pointer to it right before data
+	*( ( slab_header * )slab - 1 ) = header;
+	return slab;
+}
+
+void slab_pool_release( void *slab )
+{
+	if ( slab == NULL )
+		return;
+
+	slab_header header = slab_pool_header( slab );
+	slab_pool self = header->pool;
+
+	pthread_mutex_lock( &self->mutex );
+
+	// Slabs of outdated size or above high water mark go back to allocator
+	if ( header->size == self->slab_size && self->idle_count < self->high_water_mark )
+	{
+		header->next = self->idle;
+		self->idle = header;
+		self->idle_count++;
+	}
+	else
+	{
+		free( header );
+	}
+
+	slab_pool_unref( self );
+}
+
+void slab_pool_set_slab_size( slab_pool self, size_t slab_size )
+{
+	if ( self == NULL )
+		return;
+
+	pthread_mutex_lock( &self->mutex );
+	if ( slab_size != self->slab_size )
+	{
+		slab_pool_free_idle( self );
+		self->slab_size = slab_size;
+	}
+	pthread_mutex_unlock( &self->mutex );
+}
+
+void slab_pool_close( slab_pool self )
+{
+	if ( self == NULL )
+		return;
+
+	pthread_mutex_lock( &self->mutex );
+	slab_pool_free_idle( self );
+	// Prevent slabs released from now on from being kept idle
+	self->high_water_mark = 0;
+	slab_pool_unref( self );
+}
@@ -0,0 +1,14 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include <stddef.h>
+
+typedef struct slab_pool_s *slab_pool;
+
+extern slab_pool slab_pool_init( size_t slab_size, int high_water_mark );
+extern void *slab_pool_alloc( slab_pool self );
+extern void slab_pool_release( void *slab );
+extern void slab_pool_set_slab_size( slab_pool self, size_t slab_size );
+extern void slab_pool_close( slab_pool self );
+
+#endif
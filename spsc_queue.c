@@ -0,0 +1,123 @@
+/*
+Lock-free single producer, single consumer queue.
+
+Elements of fixed size are copied in and out of a ring. Only
+the producer thread moves tail and only the consumer thread moves
+head, so neither of them ever waits for the other. Pushing into
+a full queue and popping from an empty one fail right away.
+
+Each slot can also carry storage of variable size (see spsc_queue_reserve()),
+so data elements refer to doesn't need allocating for every push. Slot
+storage grows as needed and is kept until the queue is closed.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "spsc_queue.h"
+
+struct spsc_queue_s
+{
+	uint8_t *elements;
+	size_t element_size;
+	size_t capacity;
+	// Index of the next element to pop (written by consumer only)
+	size_t head;
+	// Index of the next element to push (written by producer only)
+	size_t tail;
+	// Storage attached to each slot (sized by producer only)
+	struct spsc_queue_storage_s
+	{
+		void *data;
+		size_t size;
+	} *storage;
+};
+
+spsc_queue spsc_queue_init( size_t element_size, size_t capacity )
+{
+	if ( element_size == 0 || capacity == 0 )
+		return NULL;
+
+	spsc_queue queue = calloc( 1, sizeof( struct spsc_queue_s ) );
+	if ( queue != NULL )
+	{
+		// One slot stays empty, so full and empty queue can be told apart
+		queue->elements = malloc( element_size * ( capacity + 1 ) );
+		queue->storage = calloc( capacity + 1, sizeof( struct spsc_queue_storage_s ) );
+		if ( queue->elements == NULL || queue->storage == NULL )
+		{
+			free( queue->elements );
+			free( queue->storage );
+			free( queue );
+			return NULL;
+		}
+		queue->element_size = element_size;
+		queue->capacity = capacity + 1;
+	}
+	return queue;
+}
+
+// Returns storage of at least size bytes belonging to the slot the next push
+// fills (NULL if it can't grow). Slot at tail is never the one consumer
+// reads, so storage stays untouched until consumer pops the element pushed
+// into it. Consumer must be done with the storage before it pops.
+void *spsc_queue_reserve( spsc_queue self, size_t size )
+{
+	struct spsc_queue_storage_s *storage = &self->storage[ __atomic_load_n( &self->tail, __ATOMIC_RELAXED ) ];
+	if ( size > storage->size )
+	{
+		void *data = realloc( storage->data, size );
+		if ( data == NULL )
+			return NULL;
+		storage->data = data;
+		storage->size = size;
+	}
+	return storage->data;
+}
+
+int spsc_queue_push( spsc_queue self, const void *element )
+{
+	size_t tail = __atomic_load_n( &self->tail, __ATOMIC_RELAXED );
+	size_t next = ( tail + 1 ) % self->capacity;
+	if ( next == __atomic_load_n( &self->head, __ATOMIC_ACQUIRE ) )
+		return 1;
+
+	memcpy( self->elements + tail * self->element_size, element, self->element_size );
+	// Element must be in place, before consumer can see it
+	__atomic_store_n( &self->tail, next, __ATOMIC_RELEASE );
+	return 0;
+}
+
+int spsc_queue_peek( spsc_queue self, void *element )
+{
+	size_t head = __atomic_load_n( &self->head, __ATOMIC_RELAXED );
+	if ( head == __atomic_load_n( &self->tail, __ATOMIC_ACQUIRE ) )
+		return 1;
+
+	memcpy( element, self->elements + head * self->element_size, self->element_size );
+	return 0;
+}
+
+int spsc_queue_pop( spsc_queue self, void *element )
+{
+	if ( spsc_queue_peek( self, element ) )
+		return 1;
+
+	size_t head = __atomic_load_n( &self->head, __ATOMIC_RELAXED );
+	// Slot may be reused by producer from now on
+	__atomic_store_n( &self->head, ( head + 1 ) % self->capacity, __ATOMIC_RELEASE );
+	return 0;
+}
+
+void spsc_queue_close( spsc_queue self )
+{
+	if ( self == NULL )
+		return;
+
+	size_t i;
+	for ( i = 0; i < self->capacity; i++ )
+		free( self->storage[ i ].data );
+	free( self->storage );
+	free( self->elements );
+	free( self );
+}
@@ -0,0 +1,15 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+
+typedef struct spsc_queue_s *spsc_queue;
+
+extern spsc_queue spsc_queue_init( size_t element_size, size_t capacity );
+extern void *spsc_queue_reserve( spsc_queue self, size_t size );
+extern int spsc_queue_push( spsc_queue self, const void *element );
+extern int spsc_queue_peek( spsc_queue self, void *element );
+extern int spsc_queue_pop( spsc_queue self, void *element );
+extern void spsc_queue_close( spsc_queue self );
+
+#endif
@@ -0,0 +1,212 @@
+/*
+Extracts strips of evenly spaced thumbnails from media.
+
+Thumbnailer has its own media player, which decodes only keyframes
+(after fast, keyframe precise seeks), without audio, and has VLC scale
+pictures down to thumbnail size. Strip is a single row of RGB24
+thumbnails, spaced evenly over the whole media.
+
+The player is kept between strips, paused while idle. Pictures are
+recognized by media position VLC reports for them: each thumbnail
+takes the first one within its slot of the strip.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "thumbnailer.h"
+
+// How long we wait for a thumbnail (in microseconds), before leaving it blank
+#define THUMBNAILER_TIMEOUT 2000000
+
+struct thumbnailer_s
+{
+	libvlc_media_t *media;
+	libvlc_media_player_t *media_player;
+	int width;
+	int height;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	// Picture VLC decodes into
+	uint8_t *picture;
+	// Copy of the accepted picture
+	uint8_t *thumbnail;
+	// Media position range of picture we're waiting for (empty if not waiting)
+	float min_position;
+	float max_position;
+	int accepted;
+	int ended;
+	int playing;
+};
+
+static void *thumbnailer_lock( void *data, void **planes )
+{
+	thumbnailer self = data;
+	planes[ 0 ] = self->picture;
+	return NULL;
+}
+
+static void thumbnailer_display( void *data, void *picture )
+{
+	thumbnailer self = data;
+	float position = libvlc_media_player_get_position( self->media_player );
+
+	pthread_mutex_lock( &self->mutex );
+	if ( !self->accepted && position >= self->min_position && position < self->max_position )
+	{
+		memcpy( self->thumbnail, self->picture, self->width * self->height * 3 );
+		self->accepted = 1;
+		pthread_cond_signal( &self->cond );
+	}
+	pthread_mutex_unlock( &self->mutex );
+}
+
+static void thumbnailer_end_reached( const struct libvlc_event_t *event, void *data )
+{
+	thumbnailer self = data;
+
+	pthread_mutex_lock( &self->mutex );
+	self->ended = 1;
+	pthread_cond_signal( &self->cond );
+	pthread_mutex_unlock( &self->mutex );
+}
+
+thumbnailer thumbnailer_init( libvlc_instance_t *vlc, const char *path, int width, int height )
+{
+	thumbnailer self = calloc( 1, sizeof( struct thumbnailer_s ) );
+	if ( self == NULL )
+		return NULL;
+
+	self->width = width;
+	self->height = height;
+	// Start with an empty range, so no picture is accepted
+	self->min_position = 1.0;
+	self->max_position = 0.0;
+	self->accepted = 1;
+	pthread_mutex_init( &self->mutex, NULL );
+	pthread_cond_init( &self->cond, NULL );
+
+	self->picture = malloc( width * height * 3 );
+	self->thumbnail = malloc( width * height * 3 );
+	if ( self->picture == NULL || self->thumbnail == NULL ) goto cleanup;
+
+	// Producer's media has options of its own, we need different ones
+	self->media = libvlc_media_new_path( vlc, path );
+	if ( self->media == NULL ) goto cleanup;
+	libvlc_media_add_option( self->media, ":no-audio" );
+	// Seek to keyframes and decode nothing else
+	libvlc_media_add_option( self->media, ":input-fast-seek" );
+	libvlc_media_add_option( self->media, ":avcodec-skip-frame=3" );
+
+	self->media_player = libvlc_media_player_new_from_media( self->media );
+	if ( self->media_player == NULL ) goto cleanup;
+
+	libvlc_video_set_callbacks( self->media_player, thumbnailer_lock, NULL, thumbnailer_display, self );
+	// VLC scales pictures down to thumbnail size
+	libvlc_video_set_format( self->media_player, "RV24", width, height, width * 3 );
+	libvlc_event_attach( libvlc_media_player_event_manager( self->media_player ),
+						 libvlc_MediaPlayerEndReached, thumbnailer_end_reached, self );
+
+	return self;
+
+cleanup:
+	thumbnailer_close( self );
+	return NULL;
+}
+
+// Fills strip (count thumbnails wide) with thumbnails. Thumbnails VLC didn't
+// deliver in time are left black. Returns number of thumbnails delivered.
+int thumbnailer_strip( thumbnailer self, int count, uint8_t *strip )
+{
+	int row_size = self->width * 3;
+	int strip_row_size = count * row_size;
+	int delivered = 0;
+	int i;
+
+	memset( strip, 0, strip_row_size * self->height );
+
+	pthread_mutex_lock( &self->mutex );
+	self->ended = 0;
+	pthread_mutex_unlock( &self->mutex );
+
+	// Player which reached the end needs to be started again
+	if ( !self->playing || libvlc_media_player_get_state( self->media_player ) == libvlc_Ended )
+	{
+		libvlc_media_player_stop( self->media_player );
+		libvlc_media_player_play( self->media_player );
+		self->playing = 1;
+	}
+	else
+	{
+		libvlc_media_player_set_pause( self->media_player, 0 );
+	}
+
+	for ( i = 0; i < count; i++ )
+	{
+		float position = ( i + 0.5 ) / count;
+
+		// Each thumbnail takes the first picture within its slot
+		pthread_mutex_lock( &self->mutex );
+		self->min_position = position - 0.5 / count;
+		self->max_position = position + 0.5 / count;
+		self->accepted = 0;
+		pthread_mutex_unlock( &self->mutex );
+
+		libvlc_media_player_set_position( self->media_player, position );
+
+		struct timespec deadline;
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_nsec += ( THUMBNAILER_TIMEOUT % 1000000 ) * 1000;
+		deadline.tv_sec += THUMBNAILER_TIMEOUT / 1000000 + deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+
+		pthread_mutex_lock( &self->mutex );
+		int timed_out = 0;
+		while ( !self->accepted && !self->ended && !timed_out )
+			timed_out = pthread_cond_timedwait( &self->cond, &self->mutex, &deadline ) == ETIMEDOUT;
+
+		if ( self->accepted )
+		{
+			int y;
+			for ( y = 0; y < self->height; y++ )
+				memcpy( strip + y * strip_row_size + i * row_size, self->thumbnail + y * row_size, row_size );
+			delivered++;
+		}
+		self->accepted = 1;
+		int ended = self->ended;
+		pthread_mutex_unlock( &self->mutex );
+
+		// Media is shorter than it seemed, nothing more to get
+		if ( ended )
+			break;
+	}
+
+	// Nothing gets decoded until next strip
+	libvlc_media_player_set_pause( self->media_player, 1 );
+
+	return delivered;
+}
+
+void thumbnailer_close( thumbnailer self )
+{
+	if ( self == NULL )
+		return;
+
+	if ( self->media_player )
+	{
+		libvlc_media_player_stop( self->media_player );
+		libvlc_event_detach( libvlc_media_player_event_manager( self->media_player ),
+							 libvlc_MediaPlayerEndReached, thumbnailer_end_reached, self );
+		libvlc_media_player_release( self->media_player );
+	}
+	if ( self->media )
+		libvlc_media_release( self->media );
+
+	free( self->picture );
+	free( self->thumbnail );
+	pthread_cond_destroy( &self->cond );
+	pthread_mutex_destroy( &self->mutex );
+	free( self );
+}
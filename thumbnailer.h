@@ -0,0 +1,13 @@
+#ifndef THUMBNAILER_H
+#define THUMBNAILER_H
+
+#include <stdint.h>
+#include <vlc/vlc.h>
+
+typedef struct thumbnailer_s *thumbnailer;
+
+extern thumbnailer thumbnailer_init( libvlc_instance_t *vlc, const char *path, int width, int height );
+extern int thumbnailer_strip( thumbnailer self, int count, uint8_t *strip );
+extern void thumbnailer_close( thumbnailer self );
+
+#endif
@@ -0,0 +1,175 @@
+/*
+Process-wide VLC instance shared by all libvlc services.
+
+Creating VLC instance loads plugin cache and module bank, which
+dominates opening a project with many libvlc clips. So there is
+only one instance, created on first vlc_instance_acquire and
+released, when the last service releases it.
+
+Logs of shared instance are routed to the service, which owns
+the media player emitting them. Media players are registered
+with vlc_instance_log_register. Messages of other VLC objects
+(input, decoders) are emitted in VLC threads, which services mark
+with vlc_instance_log_thread from their callbacks. Anything else
+is logged without service.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <framework/mlt_log.h>
+
+#include "vlc_instance.h"
+
+struct log_route_s
+{
+	// Media player emitting messages
+	libvlc_media_player_t *media_player;
+	// Service messages go to
+	mlt_service service;
+	struct log_route_s *next;
+};
+
+typedef struct log_route_s *log_route;
+
+static pthread_mutex_t instance_mutex = PTHREAD_MUTEX_INITIALIZER;
+static libvlc_instance_t *instance = NULL;
+static int instance_ref_count = 0;
+static log_route routes = NULL;
+
+// Service, which owns the VLC thread we're in
+static __thread mlt_service thread_service = NULL;
+
+static mlt_service log_service( const libvlc_log_t *ctx )
+{
+	const char *name, *header;
+	uintptr_t id = 0;
+	libvlc_log_get_object( ctx, &name, &header, &id );
+
+	mlt_service service = NULL;
+	log_route route;
+	pthread_mutex_lock( &instance_mutex );
+	for ( route = routes; route != NULL; route = route->next )
+	{
+		if ( ( uintptr_t )route->media_player == id )
+		{
+			service = route->service;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &instance_mutex );
+
+	return service != NULL ? service : thread_service;
+}
+
+static void log_cb( void *data, int vlc_level, const libvlc_log_t *ctx, const char *fmt, va_list args )
+{
+	int mlt_level;
+	switch ( vlc_level )
+	{
+		case LIBVLC_DEBUG:
+			mlt_level = MLT_LOG_DEBUG;
+			break;
+		case LIBVLC_NOTICE:
+			mlt_level = MLT_LOG_INFO;
+			break;
+		case LIBVLC_WARNING:
+			mlt_level = MLT_LOG_WARNING;
+			break;
+		case LIBVLC_ERROR:
+		default:
+			mlt_level = MLT_LOG_FATAL;
+	}
+
+	// Don't bother looking up service for messages nobody is going to see
+	if ( mlt_level > mlt_log_get_level( ) )
+		return;
+
+	// In order to get readable output from MLT default log handler,
+	// we need to end our message with newline, VLC doesn't do that
+	size_t fmt_len = strlen( fmt );
+	// + \n + \0
+	char *fmt_nl = calloc( fmt_len + 1 + 1, sizeof( char ) );
+	if ( fmt_nl == NULL )
+		return;
+
+	strcat( fmt_nl, fmt );
+	strcat( fmt_nl, "\n" );
+
+	mlt_vlog( log_service( ctx ), mlt_level, fmt_nl, args );
+
+	free( fmt_nl );
+}
+
+libvlc_instance_t *vlc_instance_acquire( void )
+{
+	pthread_mutex_lock( &instance_mutex );
+
+	if ( instance == NULL )
+	{
+		instance = libvlc_new( 0, NULL );
+		if ( instance != NULL )
+			// Pass logs to MLT
+			libvlc_log_set( instance, log_cb, NULL );
+	}
+	if ( instance != NULL )
+		instance_ref_count++;
+
+	libvlc_instance_t *vlc = instance;
+	pthread_mutex_unlock( &instance_mutex );
+
+	return vlc;
+}
+
+void vlc_instance_release( libvlc_instance_t *vlc )
+{
+	if ( vlc == NULL )
+		return;
+
+	pthread_mutex_lock( &instance_mutex );
+	int last = vlc == instance && --instance_ref_count == 0;
+	if ( last )
+		instance = NULL;
+	pthread_mutex_unlock( &instance_mutex );
+
+	// Unsetting log callback waits for messages being logged, which take our mutex
+	if ( last )
+	{
+		libvlc_log_unset( vlc );
+		libvlc_release( vlc );
+	}
+}
+
+void vlc_instance_log_register( libvlc_media_player_t *media_player, mlt_service service )
+{
+	log_route route = calloc( 1, sizeof( struct log_route_s ) );
+	if ( route == NULL )
+		return;
+
+	route->media_player = media_player;
+	route->service = service;
+
+	pthread_mutex_lock( &instance_mutex );
+	route->next = routes;
+	routes = route;
+	pthread_mutex_unlock( &instance_mutex );
+}
+
+void vlc_instance_log_unregister( libvlc_media_player_t *media_player )
+{
+	pthread_mutex_lock( &instance_mutex );
+	log_route *link = &routes;
+	while ( *link != NULL && ( *link )->media_player != media_player )
+		link = &( *link )->next;
+	log_route route = *link;
+	if ( route != NULL )
+		*link = route->next;
+	pthread_mutex_unlock( &instance_mutex );
+
+	free( route );
+}
+
+void vlc_instance_log_thread( mlt_service service )
+{
+	thread_service = service;
+}
@@ -0,0 +1,13 @@
+#ifndef VLC_INSTANCE_H
+#define VLC_INSTANCE_H
+
+#include <framework/mlt_service.h>
+#include <vlc/vlc.h>
+
+extern libvlc_instance_t *vlc_instance_acquire( void );
+extern void vlc_instance_release( libvlc_instance_t *vlc );
+extern void vlc_instance_log_register( libvlc_media_player_t *media_player, mlt_service service );
+extern void vlc_instance_log_unregister( libvlc_media_player_t *media_player );
+extern void vlc_instance_log_thread( mlt_service service );
+
+#endif
@@ -0,0 +1,334 @@
+/*
+Waveform peak files.
+
+waveform_generate pulls frames of an audio only libvlc producer
+(video isn't decoded at all) from start to end. Producer doesn't pace
+decoding, so it runs as fast as VLC can decode. Generation ends at the
+end of source's length, or earlier at the end of media, where producer
+starts delivering frames without audio (test_audio).
+
+Only s16 samples are supported, which is what libvlc producer delivers.
+Frames of any other format (e.g. float) make generation fail. Samples
+get reduced to min, max and RMS of each channel over windows of
+samples_per_peak sample frames.
+
+Reduction keeps a block of lanes spanning whole sample frames, so
+inner loops run over contiguous interleaved samples and compiler can
+vectorize them. Lanes get folded into channels at the end of window.
+
+Peak file starts with header (magic, version, channels, samplerate,
+samples_per_peak, count), followed by count records of channels
+peaks. Existing peak file newer than media and made with the same
+parameters is reused.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include <framework/mlt_producer.h>
+#include <framework/mlt_frame.h>
+#include <framework/mlt_log.h>
+
+#include "waveform.h"
+
+#define WAVEFORM_MAGIC "MLTPEAKS"
+#define WAVEFORM_VERSION 1
+// Lanes reduced at once (rounded to whole sample frames)
+#define WAVEFORM_LANES 32
+
+struct waveform_header_s
+{
+	char magic[ 8 ];
+	int32_t version;
+	int32_t channels;
+	int32_t samplerate;
+	int32_t samples_per_peak;
+	int64_t count;
+};
+
+struct waveform_s
+{
+	int channels;
+	int samples_per_peak;
+	// Lanes per block, a multiple of channels
+	int lanes;
+	// Running reduction of the current window, per lane
+	int16_t *lane_min;
+	int16_t *lane_max;
+	float *lane_square_sum;
+	// Sample frames reduced in the current window
+	int window_samples;
+	// Peaks made so far
+	waveform_peak peaks;
+	int64_t count;
+	int64_t capacity;
+	int error;
+};
+
+typedef struct waveform_s *waveform;
+
+static void waveform_reset_window( waveform self )
+{
+	int i;
+	for ( i = 0; i < self->lanes; i++ )
+	{
+		self->lane_min[ i ] = INT16_MAX;
+		self->lane_max[ i ] = INT16_MIN;
+		self->lane_square_sum[ i ] = 0;
+	}
+	self->window_samples = 0;
+}
+
+// Folds lanes into peaks of channels
+static void waveform_finish_window( waveform self )
+{
+	if ( self->window_samples == 0 )
+		return;
+
+	if ( self->count == self->capacity )
+	{
+		int64_t capacity = self->capacity ? self->capacity * 2 : 4096;
+		waveform_peak peaks = realloc( self->peaks, capacity * self->channels * sizeof( struct waveform_peak_s ) );
+		if ( peaks == NULL )
+		{
+			self->error = 1;
+			return;
+		}
+		self->peaks = peaks;
+		self->capacity = capacity;
+	}
+
+	waveform_peak peak = self->peaks + self->count * self->channels;
+	int c, i;
+	for ( c = 0; c < self->channels; c++ )
+	{
+		int16_t min = INT16_MAX, max = INT16_MIN;
+		float square_sum = 0;
+		for ( i = c; i < self->lanes; i += self->channels )
+		{
+			min = self->lane_min[ i ] < min ? self->lane_min[ i ] : min;
+			max = self->lane_max[ i ] > max ? self->lane_max[ i ] : max;
+			square_sum += self->lane_square_sum[ i ];
+		}
+		peak[ c ].min = min;
+		peak[ c ].max = max;
+		// Full scale negative square wave has RMS just over INT16_MAX
+		float rms = sqrtf( square_sum / self->window_samples ) + 0.5f;
+		peak[ c ].rms = rms < INT16_MAX ? rms : INT16_MAX;
+	}
+	self->count++;
+
+	waveform_reset_window( self );
+}
+
+// Reduces whole blocks of lanes, then sample frames left over
+static void waveform_reduce( waveform self, const int16_t *restrict samples, int frames )
+{
+	int lanes = self->lanes;
+	int frames_per_block = lanes / self->channels;
+	int16_t *restrict lane_min = self->lane_min;
+	int16_t *restrict lane_max = self->lane_max;
+	float *restrict lane_square_sum = self->lane_square_sum;
+	int block, i;
+
+	int blocks = frames / frames_per_block;
+	for ( block = 0; block < blocks; block++, samples += lanes )
+	{
+		for ( i = 0; i < lanes; i++ )
+		{
+			int16_t sample = samples[ i ];
+			lane_min[ i ] = sample < lane_min[ i ] ? sample : lane_min[ i ];
+			lane_max[ i ] = sample > lane_max[ i ] ? sample : lane_max[ i ];
+			lane_square_sum[ i ] += ( float )sample * sample;
+		}
+	}
+
+	int rest = ( frames - blocks * frames_per_block ) * self->channels;
+	for ( i = 0; i < rest; i++ )
+	{
+		int16_t sample = samples[ i ];
+		lane_min[ i ] = sample < lane_min[ i ] ? sample : lane_min[ i ];
+		lane_max[ i ] = sample > lane_max[ i ] ? sample : lane_max[ i ];
+		lane_square_sum[ i ] += ( float )sample * sample;
+	}
+
+	self->window_samples += frames;
+}
+
+static void waveform_add( waveform self, const int16_t *samples, int frames )
+{
+	while ( frames > 0 )
+	{
+		int window_left = self->samples_per_peak - self->window_samples;
+		int n = frames < window_left ? frames : window_left;
+		waveform_reduce( self, samples, n );
+		samples += n * self->channels;
+		frames -= n;
+		if ( self->window_samples == self->samples_per_peak )
+			waveform_finish_window( self );
+	}
+}
+
+// Returns 0 if peak file is up to date with media and parameters
+static int waveform_check( const char *media_path, const char *peak_path, int channels, int samplerate, int samples_per_peak )
+{
+	struct stat media_stat, peak_stat;
+	if ( stat( media_path, &media_stat ) || stat( peak_path, &peak_stat ) || peak_stat.st_mtime < media_stat.st_mtime )
+		return 1;
+
+	struct waveform_info_s info;
+	waveform_peak peaks = waveform_load( peak_path, &info );
+	free( peaks );
+	return peaks == NULL || info.channels != channels || info.samplerate != samplerate ||
+		info.samples_per_peak != samples_per_peak;
+}
+
+static int waveform_write( waveform self, const char *peak_path, int samplerate )
+{
+	struct waveform_header_s header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, WAVEFORM_MAGIC, sizeof( header.magic ) );
+	header.version = WAVEFORM_VERSION;
+	header.channels = self->channels;
+	header.samplerate = samplerate;
+	header.samples_per_peak = self->samples_per_peak;
+	header.count = self->count;
+
+	FILE *file = fopen( peak_path, "wb" );
+	if ( file == NULL )
+		return 1;
+
+	int error = fwrite( &header, sizeof( header ), 1, file ) != 1 ||
+		( self->count > 0 && fwrite( self->peaks, sizeof( struct waveform_peak_s ) * self->channels, self->count, file ) != self->count );
+	error |= fclose( file ) != 0;
+
+	if ( error )
+		remove( peak_path );
+	return error;
+}
+
+// Writes peak file for audio of source, an audio only libvlc producer, which
+// gets consumed from its start to end. Returns 0 on success (or if peak file
+// is up to date already). Generation stops early, once cancel gets set.
+int waveform_generate( mlt_producer source, const char *peak_path, int samples_per_peak, const int *cancel )
+{
+	if ( source == NULL || peak_path == NULL || samples_per_peak < 1 )
+		return 1;
+
+	mlt_properties properties = MLT_PRODUCER_PROPERTIES( source );
+	const char *media_path = mlt_properties_get( properties, "resource" );
+	int channels = mlt_properties_get_int( properties, "channels" );
+	int samplerate = mlt_properties_get_int( properties, "frequency" );
+	if ( media_path == NULL || channels < 1 || samplerate < 1 )
+		return 1;
+
+	if ( !waveform_check( media_path, peak_path, channels, samplerate, samples_per_peak ) )
+		return 0;
+
+	struct waveform_s wave;
+	waveform self = &wave;
+	memset( self, 0, sizeof( wave ) );
+	self->channels = channels;
+	self->samples_per_peak = samples_per_peak;
+	self->lanes = channels < WAVEFORM_LANES ? WAVEFORM_LANES / channels * channels : channels;
+	self->lane_min = malloc( self->lanes * sizeof( int16_t ) );
+	self->lane_max = malloc( self->lanes * sizeof( int16_t ) );
+	self->lane_square_sum = malloc( self->lanes * sizeof( float ) );
+	int error = 1;
+
+	if ( self->lane_min == NULL || self->lane_max == NULL || self->lane_square_sum == NULL )
+		goto cleanup;
+	waveform_reset_window( self );
+
+	double fps = mlt_producer_get_fps( source );
+	mlt_position length = mlt_producer_get_length( source );
+	mlt_producer_seek( source, 0 );
+
+	mlt_position position;
+	for ( position = 0; position < length && !self->error; position++ )
+	{
+		if ( __atomic_load_n( cancel, __ATOMIC_ACQUIRE ) )
+			goto cleanup;
+
+		mlt_frame frame = NULL;
+		if ( mlt_service_get_frame( MLT_PRODUCER_SERVICE( source ), &frame, 0 ) || frame == NULL )
+		{
+			self->error = 1;
+			break;
+		}
+
+		// Producer got to the end of media (or failed right away)
+		if ( mlt_properties_get_int( MLT_FRAME_PROPERTIES( frame ), "test_audio" ) )
+		{
+			self->error = position == 0;
+			mlt_frame_close( frame );
+			break;
+		}
+
+		mlt_audio_format format = mlt_audio_s16;
+		int frequency = samplerate;
+		int frame_channels = channels;
+		int samples = mlt_sample_calculator( fps, samplerate, position );
+		int16_t *pcm = NULL;
+		if ( mlt_frame_get_audio( frame, ( void ** )&pcm, &format, &frequency, &frame_channels, &samples ) ||
+			 pcm == NULL || format != mlt_audio_s16 || frame_channels != channels )
+			self->error = 1;
+		else
+			waveform_add( self, pcm, samples );
+
+		mlt_frame_close( frame );
+	}
+
+	// Last window may be shorter
+	waveform_finish_window( self );
+
+	if ( !self->error )
+		error = waveform_write( self, peak_path, samplerate );
+	else
+		mlt_log( MLT_PRODUCER_SERVICE( source ), MLT_LOG_WARNING, "waveform_generate: decoding failed at %d\n", position );
+
+cleanup:
+	free( self->lane_min );
+	free( self->lane_max );
+	free( self->lane_square_sum );
+	free( self->peaks );
+	return error;
+}
+
+// Reads peak file. Returns peaks (count records of info->channels peaks),
+// which caller frees, or NULL on failure.
+waveform_peak waveform_load( const char *peak_path, waveform_info info )
+{
+	FILE *file = fopen( peak_path, "rb" );
+	if ( file == NULL )
+		return NULL;
+
+	waveform_peak peaks = NULL;
+	struct waveform_header_s header;
+	if ( fread( &header, sizeof( header ), 1, file ) != 1 ||
+		 memcmp( header.magic, WAVEFORM_MAGIC, sizeof( header.magic ) ) ||
+		 header.version != WAVEFORM_VERSION || header.channels < 1 || header.count < 0 )
+		goto cleanup;
+
+	size_t record_size = sizeof( struct waveform_peak_s ) * header.channels;
+	peaks = malloc( header.count > 0 ? header.count * record_size : 1 );
+	if ( peaks == NULL )
+		goto cleanup;
+	if ( header.count > 0 && fread( peaks, record_size, header.count, file ) != header.count )
+	{
+		free( peaks );
+		peaks = NULL;
+		goto cleanup;
+	}
+
+	info->channels = header.channels;
+	info->samplerate = header.samplerate;
+	info->samples_per_peak = header.samples_per_peak;
+	info->count = header.count;
+
+cleanup:
+	fclose( file );
+	return peaks;
+}
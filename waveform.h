@@ -0,0 +1,33 @@
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <stdint.h>
+
+#include <framework/mlt_producer.h>
+
+struct waveform_peak_s
+{
+	int16_t min;
+	int16_t max;
+	int16_t rms;
+};
+
+typedef struct waveform_peak_s *waveform_peak;
+
+struct waveform_info_s
+{
+	int channels;
+	int samplerate;
+	// Number of sample frames each peak summarizes
+	int samples_per_peak;
+	// Number of peaks (per channel)
+	int64_t count;
+};
+
+typedef struct waveform_info_s *waveform_info;
+
+// Source must deliver s16 audio, generation fails on any other format
+extern int waveform_generate( mlt_producer source, const char *peak_path, int samples_per_peak, const int *cancel );
+extern waveform_peak waveform_load( const char *peak_path, waveform_info info );
+
+#endif